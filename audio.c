@@ -1,11 +1,54 @@
-#include <libgen.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#ifdef USE_ALSA
+#include <alsa/asoundlib.h>
+#endif
+#ifndef NOTIFICATIONS_DAEMON
 #define NOTIFICATIONS_DAEMON "/usr/local/bin/herbe"
+#endif
 #define BUFFER_SIZE 128
+#define VOLUME_STEP 5
+#define COALESCE_MS 100
+#define NOTIFICATION_MS 1000
+#define SOCKET_NAME "mwmp-%s-audio.sock" /* %s is $DISPLAY, as in mwmp's socket names */
+#define OSD_SOCKET_NAME "mwmp-%s-osd.sock"
+#define USAGE "Usage: %s [-b backend] {-d | + | - | aud | mic}\n"
+extern char** environ;
+
+/* a mixer backend reports volume in percent and mute state as 1 (on) / 0 (off) / -1 (error) */
+typedef struct {
+  const char* name;
+  int (*open)(void);
+  int (*get_volume)(void);
+  int (*set_volume)(int percent);
+  int (*toggle_playback)(void);
+  int (*toggle_capture)(void);
+  void (*close)(void);
+} MixerBackend;
+
+static int fake_volume   = 50;
+static int fake_playback = 1;
+static int fake_capture  = 1;
+static int fake_open(void) { return 0; }
+static int fake_get_volume(void) { return fake_volume; }
+static int fake_set_volume(int percent) { return fake_volume = percent; }
+static int fake_toggle_playback(void) { return fake_playback = !fake_playback; }
+static int fake_toggle_capture(void) { return fake_capture = !fake_capture; }
+static void fake_close(void) {}
+
 char* execute_command(const char* cmd) {
   FILE* pipe = popen(cmd, "r");
   if (!pipe) {
@@ -24,81 +67,320 @@ char* execute_command(const char* cmd) {
   pclose(pipe);
   return NULL;
 }
-void execute_command_no_output(const char* cmd) { system(cmd); }
-void kill_notification_daemon() {
+static int amixer_open(void) { return 0; }
+static int amixer_get_volume(void) {
+  char* result = execute_command("amixer get Master | awk -F'[][]' '/%/ { print $2; exit }'");
+  return result ? atoi(result) : -1;
+}
+static int amixer_set_volume(int percent) {
   char cmd[BUFFER_SIZE];
-  snprintf(cmd, BUFFER_SIZE, "pkill -x %s", basename((char*)NOTIFICATIONS_DAEMON));
-  system(cmd);
+  snprintf(cmd, BUFFER_SIZE, "amixer set Master %d%% > /dev/null", percent);
+  return system(cmd) == 0 ? percent : -1;
 }
-void show_notification(const char* message) {
+static int amixer_toggle(const char* control, const char* off, const char* on) {
   char cmd[BUFFER_SIZE];
-  kill_notification_daemon();
-  snprintf(cmd, BUFFER_SIZE, "%s \"%s\" &", NOTIFICATIONS_DAEMON, message);
-  system(cmd);
-  sleep(1);
-  kill_notification_daemon();
+  snprintf(cmd, BUFFER_SIZE, "amixer get %s | grep '\\[off\\]' -c", control);
+  char* result = execute_command(cmd);
+  if (!result) return -1;
+  int enable = atoi(result) != 0;
+  snprintf(cmd, BUFFER_SIZE, "amixer set %s %s > /dev/null", control, enable ? on : off);
+  return system(cmd) == 0 ? enable : -1;
 }
-char* get_volume() {
-  static char volume[BUFFER_SIZE];
-  char* result = execute_command("amixer get Master | awk -F'[][]' '/%/ { print $2; exit }'");
-  if (result) {
-    strncpy(volume, result, BUFFER_SIZE);
-    return volume;
+static int amixer_toggle_playback(void) { return amixer_toggle("Master", "mute", "unmute"); }
+static int amixer_toggle_capture(void) { return amixer_toggle("Capture", "nocap", "cap"); }
+static void amixer_close(void) {}
+
+#ifdef USE_ALSA
+static snd_mixer_t* mixer;
+static snd_mixer_elem_t* master;
+static snd_mixer_elem_t* capture;
+static snd_mixer_elem_t* find_elem(const char* name) {
+  snd_mixer_selem_id_t* sid;
+  snd_mixer_selem_id_alloca(&sid);
+  snd_mixer_selem_id_set_name(sid, name);
+  return snd_mixer_find_selem(mixer, sid);
+}
+static int alsa_open(void) {
+  if (snd_mixer_open(&mixer, 0) < 0) return -1;
+  if (snd_mixer_attach(mixer, "default") < 0 || snd_mixer_selem_register(mixer, NULL, NULL) < 0 ||
+      snd_mixer_load(mixer) < 0) {
+    snd_mixer_close(mixer);
+    return -1;
   }
-  return NULL;
+  master  = find_elem("Master");
+  capture = find_elem("Capture");
+  return master ? 0 : -1;
 }
-void control_volume(const char* direction) {
-  if (strcmp(direction, "+") == 0) {
-    execute_command_no_output("amixer set Master 5%+ > /dev/null");
-  } else if (strcmp(direction, "-") == 0) {
-    execute_command_no_output("amixer set Master 5%- > /dev/null");
-  } else {
-    fprintf(stderr, "Invalid volume control direction\n");
+static int alsa_get_volume(void) {
+  long min, max, vol;
+  snd_mixer_handle_events(mixer);
+  snd_mixer_selem_get_playback_volume_range(master, &min, &max);
+  if (max <= min || snd_mixer_selem_get_playback_volume(master, 0, &vol) < 0) return -1;
+  return (int)((vol - min) * 100 / (max - min));
+}
+static int alsa_set_volume(int percent) {
+  long min, max;
+  snd_mixer_selem_get_playback_volume_range(master, &min, &max);
+  if (snd_mixer_selem_set_playback_volume_all(master, min + (max - min) * percent / 100) < 0) {
+    return -1;
+  }
+  return percent;
+}
+static int alsa_toggle_playback(void) {
+  int on;
+  snd_mixer_handle_events(mixer);
+  if (snd_mixer_selem_get_playback_switch(master, 0, &on) < 0) return -1;
+  return snd_mixer_selem_set_playback_switch_all(master, !on) < 0 ? -1 : !on;
+}
+static int alsa_toggle_capture(void) {
+  int on;
+  snd_mixer_handle_events(mixer);
+  if (!capture || snd_mixer_selem_get_capture_switch(capture, 0, &on) < 0) return -1;
+  return snd_mixer_selem_set_capture_switch_all(capture, !on) < 0 ? -1 : !on;
+}
+static void alsa_close(void) { snd_mixer_close(mixer); }
+#endif
+
+static const MixerBackend backends[] = {
+#ifdef USE_ALSA
+    {"alsa", alsa_open, alsa_get_volume, alsa_set_volume, alsa_toggle_playback,
+     alsa_toggle_capture, alsa_close},
+#endif
+    {"amixer", amixer_open, amixer_get_volume, amixer_set_volume, amixer_toggle_playback,
+     amixer_toggle_capture, amixer_close},
+    {"fake", fake_open, fake_get_volume, fake_set_volume, fake_toggle_playback,
+     fake_toggle_capture, fake_close}};
+static const MixerBackend* backend = &backends[0];
+
+static pid_t notification_pid;
+static int notification_timer = -1;
+static posix_spawnattr_t spawn_attr;
+static void arm_timer(int fd, long ms) {
+  struct itimerspec its = {.it_value = {ms / 1000, (ms % 1000) * 1000000L}};
+  timerfd_settime(fd, 0, &its, NULL);
+}
+/* children start with an empty signal mask even though the daemon blocks SIGCHLD */
+static void setup_spawn(void) {
+  sigset_t none;
+  sigemptyset(&none);
+  posix_spawnattr_init(&spawn_attr);
+  posix_spawnattr_setsigmask(&spawn_attr, &none);
+  posix_spawnattr_setflags(&spawn_attr, POSIX_SPAWN_SETSIGMASK);
+}
+void kill_notification_daemon() {
+  if (notification_pid > 0) {
+    kill(notification_pid, SIGTERM);
+    notification_pid = 0;
     return;
   }
-  char* new_vol = get_volume();
-  if (new_vol) {
-    char msg[BUFFER_SIZE];
-    snprintf(msg, BUFFER_SIZE, "vol %s", new_vol);
-    show_notification(msg);
+  if (notification_timer >= 0) return;
+  /* one-shot mode: the herbe still showing came from an earlier run, so only its name is known */
+  const char* name = strrchr(NOTIFICATIONS_DAEMON, '/');
+  char* argv[]     = {"pkill", "-x", (char*)(name ? name + 1 : NOTIFICATIONS_DAEMON), NULL};
+  pid_t pid;
+  if (posix_spawnp(&pid, argv[0], NULL, &spawn_attr, argv, environ) == 0) {
+    waitpid(pid, NULL, 0);
   }
 }
-void toggle_audio() {
-  int status = atoi(execute_command("amixer get Master | grep '\\[off\\]' -c"));
-  if (status == 0) {
-    execute_command_no_output("amixer set Master mute");
-    show_notification("aud off");
+static int socket_address(struct sockaddr_un* addr, const char* format) {
+  const char* dir     = getenv("XDG_RUNTIME_DIR");
+  const char* display = getenv("DISPLAY");
+  char name[sizeof(addr->sun_path)];
+  int len = snprintf(name, sizeof(name), format, display ? display : "");
+  if (len < 0 || (size_t)len >= sizeof(name)) return 0;
+  for (char* p = name; *p; p++) {
+    if (*p == '/') *p = '_';
+  }
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (dir) {
+    len = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%s", dir, name);
   } else {
-    execute_command_no_output("amixer set Master unmute");
-    show_notification("aud on");
+    len = snprintf(addr->sun_path, sizeof(addr->sun_path), "/tmp/%u-%s", getuid(), name);
   }
+  return len > 0 && (size_t)len < sizeof(addr->sun_path);
 }
-void toggle_mic() {
-  int status = atoi(execute_command("amixer get Capture | grep '\\[off\\]' -c"));
-  if (status == 0) {
-    execute_command_no_output("amixer set Capture nocap");
-    show_notification("mic off");
+static int send_datagram(const char* name, const char* msg) {
+  struct sockaddr_un addr;
+  if (!socket_address(&addr, name)) return -1;
+  int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  ssize_t n = sendto(fd, msg, strlen(msg), 0, (struct sockaddr*)&addr, sizeof(addr));
+  close(fd);
+  return n < 0 ? -1 : 0;
+}
+/* level is 0-100 for a volume bar or -1 for plain text */
+void show_notification(const char* message, int level) {
+  char osd[BUFFER_SIZE];
+  snprintf(osd, BUFFER_SIZE, "%d %s", level, message);
+  /* mwmp draws the message in its own overlay; herbe is only the fallback */
+  if (send_datagram(OSD_SOCKET_NAME, osd) == 0) return;
+  char* argv[] = {NOTIFICATIONS_DAEMON, (char*)message, NULL};
+  kill_notification_daemon();
+  if (posix_spawn(&notification_pid, argv[0], NULL, &spawn_attr, argv, environ) != 0) {
+    notification_pid = 0;
+    return;
+  }
+  if (notification_timer >= 0) {
+    arm_timer(notification_timer, NOTIFICATION_MS);
   } else {
-    execute_command_no_output("amixer set Capture cap");
-    show_notification("mic on");
+    /* one-shot mode: nothing else will ever replace it, so leave herbe to its own timeout */
+    notification_pid = 0;
   }
 }
-int main(int argc, char* argv[]) {
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s {+ | - | aud | mic}\n", argv[0]);
-    return 1;
-  }
-  if (strcmp(argv[1], "+") == 0) {
-    control_volume("+");
-  } else if (strcmp(argv[1], "-") == 0) {
-    control_volume("-");
-  } else if (strcmp(argv[1], "aud") == 0) {
+void change_volume(int steps) {
+  int volume = backend->get_volume();
+  if (volume < 0) return;
+  volume += steps * VOLUME_STEP;
+  if (volume < 0) volume = 0;
+  if (volume > 100) volume = 100;
+  if (backend->set_volume(volume) < 0) return;
+  char msg[BUFFER_SIZE];
+  snprintf(msg, BUFFER_SIZE, "vol %d%%", volume);
+  show_notification(msg, volume);
+}
+void toggle_audio() {
+  int on = backend->toggle_playback();
+  if (on >= 0) show_notification(on ? "aud on" : "aud off", -1);
+}
+void toggle_mic() {
+  int on = backend->toggle_capture();
+  if (on >= 0) show_notification(on ? "mic on" : "mic off", -1);
+}
+static int valid_command(const char* cmd) {
+  return strcmp(cmd, "+") == 0 || strcmp(cmd, "-") == 0 || strcmp(cmd, "aud") == 0 ||
+         strcmp(cmd, "mic") == 0;
+}
+static void run_command(const char* cmd) {
+  if (strcmp(cmd, "+") == 0) {
+    change_volume(1);
+  } else if (strcmp(cmd, "-") == 0) {
+    change_volume(-1);
+  } else if (strcmp(cmd, "aud") == 0) {
     toggle_audio();
-  } else if (strcmp(argv[1], "mic") == 0) {
+  } else if (strcmp(cmd, "mic") == 0) {
     toggle_mic();
-  } else {
-    fprintf(stderr, "Usage: %s {+ | - | aud | mic}\n", argv[0]);
+  }
+}
+static int send_command(const char* cmd) { return send_datagram(SOCKET_NAME, cmd); }
+static int run_daemon(void) {
+  struct sockaddr_un addr;
+  if (!socket_address(&addr, SOCKET_NAME)) return 1;
+  int sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  unlink(addr.sun_path);
+  if (sock < 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    perror("audio: socket");
+    return 1;
+  }
+  int coalesce_timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  notification_timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (coalesce_timer < 0 || notification_timer < 0) {
+    perror("audio: timerfd");
+    return 1;
+  }
+  /* herbe is reaped here; system() and popen() still wait for their own children */
+  sigset_t chld;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, NULL);
+  int child_fd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (child_fd < 0) {
+    perror("audio: signalfd");
     return 1;
   }
+  /* the first step is applied at once; steps arriving inside the window are merged into one
+     mixer write and one notification when it closes */
+  int pending_steps = 0, window_open = 0;
+  struct pollfd fds[] = {{sock, POLLIN, 0}, {coalesce_timer, POLLIN, 0},
+                         {notification_timer, POLLIN, 0}, {child_fd, POLLIN, 0}};
+  for (;;) {
+    if (poll(fds, 4, -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    uint64_t expirations;
+    if ((fds[1].revents & POLLIN) && read(coalesce_timer, &expirations, sizeof(expirations)) > 0) {
+      window_open = 0;
+      if (pending_steps) {
+        change_volume(pending_steps);
+        pending_steps = 0;
+        window_open   = 1;
+        arm_timer(coalesce_timer, COALESCE_MS);
+      }
+    }
+    if ((fds[2].revents & POLLIN) &&
+        read(notification_timer, &expirations, sizeof(expirations)) > 0) {
+      kill_notification_daemon();
+    }
+    if (fds[3].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      while (read(child_fd, &info, sizeof(info)) > 0) continue;
+      while (waitpid(-1, NULL, WNOHANG) > 0) continue;
+    }
+    if (fds[0].revents & POLLIN) {
+      char cmd[16];
+      ssize_t n = recv(sock, cmd, sizeof(cmd) - 1, 0);
+      if (n <= 0) continue;
+      cmd[n] = '\0';
+      if (strcmp(cmd, "+") == 0 || strcmp(cmd, "-") == 0) {
+        int step = cmd[0] == '+' ? 1 : -1;
+        if (window_open) {
+          pending_steps += step;
+        } else {
+          change_volume(step);
+          window_open = 1;
+          arm_timer(coalesce_timer, COALESCE_MS);
+        }
+      } else if (valid_command(cmd)) {
+        if (pending_steps) change_volume(pending_steps);
+        pending_steps = 0;
+        run_command(cmd);
+      }
+    }
+  }
+  backend->close();
+  unlink(addr.sun_path);
   return 0;
 }
+int main(int argc, char* argv[]) {
+  int daemon_mode     = 0;
+  const char* command = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-d") == 0) {
+      daemon_mode = 1;
+    } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      const MixerBackend* found = NULL;
+      for (size_t j = 0; j < sizeof(backends) / sizeof(backends[0]); j++) {
+        if (strcmp(backends[j].name, argv[i + 1]) == 0) found = &backends[j];
+      }
+      if (!found) {
+        fprintf(stderr, "Unknown mixer backend %s\n", argv[++i]);
+        return 1;
+      }
+      backend = found;
+      i++;
+    } else if (!command && valid_command(argv[i])) {
+      command = argv[i];
+    } else {
+      fprintf(stderr, USAGE, argv[0]);
+      return 1;
+    }
+  }
+  if (daemon_mode == !!command) {
+    fprintf(stderr, USAGE, argv[0]);
+    return 1;
+  }
+  setup_spawn();
+  /* hand the command to a running daemon; without one, apply it directly */
+  if (command && send_command(command) == 0) return 0;
+  if (backend->open() < 0) {
+    fprintf(stderr, "Cannot open %s mixer\n", backend->name);
+    return 1;
+  }
+  if (command) {
+    run_command(command);
+    backend->close();
+    return 0;
+  }
+  return run_daemon();
+}
@@ -1,6 +1,19 @@
 #!/bin/bash
 notifications_daemon="/usr/local/bin/herbe"
 
+# notify MESSAGE [LEVEL]: mwmp's own overlay first, herbe only when mwmp is not listening
+notify() {
+    if [ -n "$2" ]; then
+        mwmp -l "$2" "$1" 2> /dev/null && return
+    else
+        mwmp -m "$1" 2> /dev/null && return
+    fi
+    pkill -x $(basename "$notifications_daemon")
+    $notifications_daemon "$1" &
+    sleep 1
+    pkill -x $(basename "$notifications_daemon")
+}
+
 control_volume() {
     VOL_STATUS=$(amixer get Master | awk -F'[][]' '/%/ { print $2; exit }')
     if [ "$1" == "+" ]; then
@@ -12,13 +25,10 @@ control_volume() {
     fi
     NEW_VOL=$(amixer get Master | awk -F'[][]' '/%/ { print $2; exit }')
     if [ "$VOL_STATUS" != "$NEW_VOL" ]; then
-        pkill -x $(basename "$notifications_daemon")
         MSG="vol $NEW_VOL"
         [[ "$NEW_VOL" == "100%" ]] && MSG="vol max"
         [[ "$NEW_VOL" == "0%" ]] && MSG="vol zero"
-        $notifications_daemon "$MSG" &
-        sleep 1
-        pkill -x $(basename "$notifications_daemon")
+        notify "$MSG" "${NEW_VOL%\%}"
     fi
 }
 
@@ -31,9 +41,7 @@ toggle_audio() {
         amixer set Master unmute
         MESSAGE="aud on"
     fi
-    $notifications_daemon "$MESSAGE" &
-    sleep 1
-    pkill -x $(basename "$notifications_daemon")
+    notify "$MESSAGE"
 }
 
 toggle_mic() {
@@ -45,9 +53,7 @@ toggle_mic() {
         amixer set Capture cap
         MESSAGE="mic on"
     fi
-    $notifications_daemon "$MESSAGE" &
-    sleep 1
-    pkill -x $(basename "$notifications_daemon")
+    notify "$MESSAGE"
 }
 
 case "$1" in
@@ -0,0 +1,74 @@
+#!/bin/bash
+# bench.sh [RESULTS] [LABEL=MWMP]...: run the synthetic client against each MWMP build (by
+# default mwmp=./mwmp) on a private Xvfb and write the results as JSON to RESULTS
+# (bench-results.json), so builds and commits can be compared.
+# BENCH_WINDOWS, BENCH_ITERATIONS and BENCH_TERMINALS size the run.
+set -e
+
+bench_dir=$(cd "$(dirname "$0")" && pwd)
+results=${1:-bench-results.json}
+shift || true
+[ $# -gt 0 ] || set -- mwmp=./mwmp
+client="$bench_dir/client"
+
+command -v Xvfb > /dev/null || { echo "bench: Xvfb is not installed" >&2; exit 1; }
+[ -x "$client" ] || { echo "bench: build $client first (make bench)" >&2; exit 1; }
+
+work=$(mktemp -d)
+xvfb_pid=
+wm_pid=
+cleanup() {
+    [ -n "$wm_pid" ] && kill "$wm_pid" 2> /dev/null
+    [ -n "$xvfb_pid" ] && kill "$xvfb_pid" 2> /dev/null
+    wait 2> /dev/null
+    rm -rf "$work"
+}
+trap cleanup EXIT
+
+# the client stands in for the terminal Mod+Return and the pool start
+mkdir "$work/bin"
+ln -s "$client" "$work/bin/st"
+export PATH="$work/bin:$PATH"
+export XDG_RUNTIME_DIR="$work"
+
+# -displayfd picks a free display and tells us which one once the server accepts clients
+exec 3> "$work/display"
+Xvfb -displayfd 3 -screen 0 1920x1080x24 -nolisten tcp 2> "$work/xvfb.log" &
+xvfb_pid=$!
+for _ in $(seq 100); do
+    [ -s "$work/display" ] && break
+    sleep 0.05
+done
+[ -s "$work/display" ] || { cat "$work/xvfb.log" >&2; exit 1; }
+export DISPLAY=":$(head -n 1 "$work/display")"
+
+# run LABEL MWMP: one mwmp session driven by the client, its JSON appended to the runs
+runs=
+run() {
+    "$2" 2> "$work/$1.log" &
+    wm_pid=$!
+    local out
+    out=$("$client" -p "$wm_pid" -m "$work/mwmp-metrics.json" -l "$1" \
+        -n "${BENCH_WINDOWS:-20}" -i "${BENCH_ITERATIONS:-100}" -t "${BENCH_TERMINALS:-20}")
+    kill "$wm_pid"
+    wait "$wm_pid" 2> /dev/null || true
+    wm_pid=
+    runs="${runs:+$runs,}$out"
+}
+for build in "$@"; do
+    run "${build%%=*}" "$(realpath "${build#*=}")"
+done
+
+# relayout cost of one desktop with 500 windows, replayed without X: each resize retiles them all
+{
+    for i in $(seq 500); do echo "map $i"; done
+    echo flush
+    for _ in $(seq 1000); do printf 'resize 50\nflush\nresize -50\nflush\n'; done
+} > "$work/relayout.trace"
+relayout=$("${1#*=}" -r "$work/relayout.trace" |
+    awk '/^relayout p50/ { printf "{\"windows\":500,\"p50_us\":%s,\"p99_us\":%s}", $3, $6 }')
+
+commit=$(git -C "$bench_dir" rev-parse --short HEAD 2> /dev/null || echo unknown)
+printf '{"commit":"%s","relayout":%s,"runs":[%s]}\n' "$commit" "${relayout:-null}" "$runs" \
+    > "$results"
+echo "bench: results written to $results"
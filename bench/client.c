@@ -0,0 +1,490 @@
+/*
+ * Synthetic client for make bench. It drives a running mwmp through the X server the way a
+ * user would, with real client windows and XTest key and button presses, and prints one JSON
+ * object with the latency of every scenario and the X requests mwmp sent for it.
+ *
+ * A scenario's latency runs from the request (map, unmap, destroy or key press) until the event
+ * that shows mwmp finished with it. Request counts come from mwmp's own metrics snapshot, so
+ * they cover everything mwmp sent, not just the requests that caused the awaited event.
+ *
+ * Started as "st" (bench.sh links it into PATH under that name) it stands in for the terminal:
+ * it maps one window carrying its exec time and _NET_WM_PID and exits once that is destroyed.
+ */
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XTest.h>
+#include <X11/keysym.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_WINDOWS 256
+#define MAX_SAMPLES 4096
+#define TIMEOUT_MS 2000
+#define READY_TIMEOUT_MS 5000
+#define METRICS_SIZE 65536
+#define DRAG_STEPS 1000 /* pointer motions per drag, one per DRAG_STEP_US like a 1 kHz mouse */
+#define DRAG_STEP_US 1000
+#define TERMINAL_PAUSE_MS 100 /* between Mod+Return presses, so a pool has time to refill */
+
+typedef enum {
+  ScenarioMap,
+  ScenarioUnmap,
+  ScenarioDestroy,
+  ScenarioFocus,
+  ScenarioView,
+  ScenarioMove,
+  ScenarioDrag,
+  ScenarioSpawn,
+  ScenarioTerminal,
+  ScenarioCount
+} ScenarioId;
+typedef struct {
+  const char *name;
+  long samples[MAX_SAMPLES]; /* nanoseconds */
+  int count;
+  int timeouts;
+  unsigned long requests; /* sent by mwmp while the scenario ran */
+  unsigned long exposes;  /* received by our windows */
+  unsigned long configures;
+  long ns; /* wall time of the whole scenario */
+} Scenario;
+static Scenario scenarios[ScenarioCount] = {
+    [ScenarioMap] = {.name = "map"},         [ScenarioUnmap] = {.name = "unmap"},
+    [ScenarioDestroy] = {.name = "destroy"}, [ScenarioFocus] = {.name = "focus"},
+    [ScenarioView] = {.name = "view"},       [ScenarioMove] = {.name = "move"},
+    [ScenarioDrag] = {.name = "drag"},       [ScenarioSpawn] = {.name = "spawn"},
+    [ScenarioTerminal] = {.name = "terminal"}};
+typedef struct {
+  int type;
+  Window win;     /* None matches any window */
+  Window exclude; /* never matches, e.g. the window that was just unmapped */
+  Atom atom;      /* for PropertyNotify */
+  _Bool foreign;  /* MapNotify of a window we did not create */
+} Wait;
+
+static Display *dpy;
+static Window root;
+static Window windows[MAX_WINDOWS];
+static int windowCount;
+static Scenario *current;
+static pid_t wmPid;
+static char metricsPath[4096];
+static Atom netCurrentDesktop, netWmDesktop, netSupportingWmCheck, benchExec;
+static KeyCode superKey, shiftKey;
+static Window lastForeign; /* set when a Wait with foreign matched */
+
+static void die(const char *msg) {
+  fprintf(stderr, "bench: %s\n", msg);
+  exit(EXIT_FAILURE);
+}
+static long nowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+static _Bool isOurs(Window win) {
+  for (int i = 0; i < windowCount; i++) {
+    if (windows[i] == win) return 1;
+  }
+  return 0;
+}
+/* the window an event is about, rather than the one it was reported on */
+static Window subject(const XEvent *e) {
+  switch (e->type) {
+    case MapNotify:
+      return e->xmap.window;
+    case UnmapNotify:
+      return e->xunmap.window;
+    case ConfigureNotify:
+      return e->xconfigure.window;
+    case DestroyNotify:
+      return e->xdestroywindow.window;
+    default:
+      return e->xany.window;
+  }
+}
+static _Bool matches(const XEvent *e, const Wait *w) {
+  Window win = subject(e);
+  if (e->type != w->type || win == w->exclude) return 0;
+  if (w->win != None && win != w->win) return 0;
+  if (e->type == PropertyNotify && e->xproperty.atom != w->atom) return 0;
+  if (e->type == FocusIn && (e->xfocus.mode == NotifyGrab || e->xfocus.mode == NotifyUngrab ||
+                             e->xfocus.detail == NotifyPointer)) {
+    return 0;
+  }
+  if (w->foreign) {
+    if (isOurs(win) || e->xmap.override_redirect) return 0;
+    lastForeign = win;
+  } else if (w->win == None && e->type != PropertyNotify && !isOurs(win)) {
+    return 0;
+  }
+  return 1;
+}
+static void count(const XEvent *e) {
+  if (!current) return;
+  if (e->type == Expose) current->exposes++;
+  /* root reports children's configures too while a terminal is awaited; count each once */
+  if (e->type == ConfigureNotify && e->xconfigure.event == e->xconfigure.window) {
+    current->configures++;
+  }
+}
+/* handles events until one matches, returns the nanoseconds since start or -1 on timeout */
+static long waitFor(const Wait *w, long start) {
+  XEvent e;
+  for (;;) {
+    while (XPending(dpy)) {
+      XNextEvent(dpy, &e);
+      count(&e);
+      if (w && matches(&e, w)) return nowNs() - start;
+    }
+    long left = (w ? TIMEOUT_MS : 0) - (nowNs() - start) / 1000000;
+    if (left <= 0) return -1;
+    struct pollfd pfd = {ConnectionNumber(dpy), POLLIN, 0};
+    poll(&pfd, 1, left);
+  }
+}
+/* waits for w, recording the latency in the current scenario */
+static void record(const Wait *w, long start) {
+  long ns = waitFor(w, start);
+  if (ns < 0) {
+    current->timeouts++;
+  } else if (current->count < MAX_SAMPLES) {
+    current->samples[current->count++] = ns;
+  }
+}
+/* events that belong to no sample, e.g. the tail of the previous scenario */
+static void drain(void) {
+  XSync(dpy, False);
+  waitFor(NULL, nowNs());
+}
+/* total requests mwmp has sent, from a fresh SIGUSR1 metrics snapshot */
+static unsigned long wmRequests(void) {
+  struct stat before = {0}, after;
+  stat(metricsPath, &before);
+  if (kill(wmPid, SIGUSR1) < 0) die("cannot signal mwmp");
+  long start = nowNs();
+  /* snapshots are renamed into place, so a new inode means the new one is complete */
+  while (stat(metricsPath, &after) < 0 || after.st_ino == before.st_ino) {
+    if (nowNs() - start > TIMEOUT_MS * 1000000L) die("no metrics snapshot from mwmp");
+    usleep(1000);
+  }
+  static char buf[METRICS_SIZE];
+  FILE *f = fopen(metricsPath, "r");
+  if (!f) die("cannot read the metrics snapshot");
+  size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+  buf[len]     = '\0';
+  char *totals = strstr(buf, "\"relayouts\":");
+  char *p      = totals ? strstr(totals, "\"requests\":") : NULL;
+  if (!p) die("no request count in the metrics snapshot");
+  return strtoul(p + strlen("\"requests\":"), NULL, 10);
+}
+static void begin(ScenarioId id) {
+  drain();
+  current           = &scenarios[id];
+  current->requests = wmRequests();
+  current->ns       = nowNs();
+}
+static void end(void) {
+  drain();
+  current->ns       = nowNs() - current->ns;
+  current->requests = wmRequests() - current->requests;
+  current           = NULL;
+}
+static void pressKey(KeySym sym, _Bool shift) {
+  KeyCode key = XKeysymToKeycode(dpy, sym);
+  XTestFakeKeyEvent(dpy, superKey, True, CurrentTime);
+  if (shift) XTestFakeKeyEvent(dpy, shiftKey, True, CurrentTime);
+  XTestFakeKeyEvent(dpy, key, True, CurrentTime);
+  XTestFakeKeyEvent(dpy, key, False, CurrentTime);
+  if (shift) XTestFakeKeyEvent(dpy, shiftKey, False, CurrentTime);
+  XTestFakeKeyEvent(dpy, superKey, False, CurrentTime);
+  XFlush(dpy);
+}
+static Window createWindow(void) {
+  XSetWindowAttributes wa = {.background_pixel = BlackPixel(dpy, DefaultScreen(dpy)),
+                             .event_mask       = StructureNotifyMask | ExposureMask |
+                                           FocusChangeMask | PropertyChangeMask};
+  Window win = XCreateWindow(dpy, root, 0, 0, 320, 240, 0, CopyFromParent, InputOutput,
+                             CopyFromParent, CWBackPixel | CWEventMask, &wa);
+  windows[windowCount++] = win;
+  return win;
+}
+static void forgetWindow(Window win) {
+  for (int i = 0; i < windowCount; i++) {
+    if (windows[i] == win) windows[i] = windows[--windowCount];
+  }
+}
+static Window focusedWindow(void) {
+  Window win;
+  int revert;
+  XGetInputFocus(dpy, &win, &revert);
+  return win;
+}
+static void mapWindows(int n) {
+  begin(ScenarioMap);
+  for (int i = 0; i < n && windowCount < MAX_WINDOWS; i++) {
+    Window win = createWindow();
+    long start = nowNs();
+    XMapWindow(dpy, win);
+    XFlush(dpy);
+    record(&(Wait){.type = MapNotify, .win = win}, start);
+  }
+  end();
+}
+/* the remaining windows are retiled, so a configure of any of them marks the end */
+static void unmapWindows(int iterations) {
+  begin(ScenarioUnmap);
+  for (int i = 0; i < iterations && windowCount > 1; i++) {
+    Window win = windows[windowCount - 1];
+    long start = nowNs();
+    XUnmapWindow(dpy, win);
+    XFlush(dpy);
+    record(&(Wait){.type = ConfigureNotify, .exclude = win}, start);
+    XMapWindow(dpy, win);
+    XFlush(dpy);
+    waitFor(&(Wait){.type = MapNotify, .win = win}, nowNs());
+  }
+  end();
+}
+static void destroyWindows(void) {
+  begin(ScenarioDestroy);
+  while (windowCount > 1) {
+    Window win = windows[windowCount - 1];
+    long start = nowNs();
+    XDestroyWindow(dpy, win);
+    XFlush(dpy);
+    record(&(Wait){.type = ConfigureNotify, .exclude = win}, start);
+    forgetWindow(win);
+  }
+  end();
+  XDestroyWindow(dpy, windows[0]);
+  forgetWindow(windows[0]);
+  drain();
+}
+static void focusWindows(int iterations) {
+  begin(ScenarioFocus);
+  for (int i = 0; i < iterations; i++) {
+    Window before = focusedWindow();
+    long start    = nowNs();
+    pressKey(XK_j, 0);
+    record(&(Wait){.type = FocusIn, .exclude = before}, start);
+  }
+  end();
+}
+/* mwmp publishes _NET_CURRENT_DESKTOP after it has sent the whole switch */
+static void view(int desktop, _Bool timed) {
+  Wait w     = {.type = PropertyNotify, .win = root, .atom = netCurrentDesktop};
+  long start = nowNs();
+  pressKey(XK_1 + desktop, 0);
+  if (timed) {
+    record(&w, start);
+  } else {
+    waitFor(&w, start);
+  }
+}
+static void switchDesktops(int iterations) {
+  begin(ScenarioView);
+  for (int i = 0; i < iterations; i++) {
+    view(1, 1);
+    view(0, 1);
+  }
+  end();
+}
+/* moves focused windows to the other desktop and back, _NET_WM_DESKTOP marks each move */
+static void moveWindows(int iterations) {
+  int n = iterations < windowCount - 1 ? iterations : windowCount - 1;
+  begin(ScenarioMove);
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < n; i++) {
+      Window win = focusedWindow();
+      long start = nowNs();
+      pressKey(XK_1 + !pass, 1);
+      record(&(Wait){.type = PropertyNotify, .win = win, .atom = netWmDesktop}, start);
+    }
+    view(!pass, 0);
+  }
+  end();
+}
+/* Mod+Button1 across the screen at mouse rate; mwmp should configure once per frame */
+static void drag(void) {
+  int width = DisplayWidth(dpy, DefaultScreen(dpy));
+  begin(ScenarioDrag);
+  XTestFakeMotionEvent(dpy, DefaultScreen(dpy), width / 4, 100, CurrentTime);
+  XTestFakeKeyEvent(dpy, superKey, True, CurrentTime);
+  XTestFakeButtonEvent(dpy, Button1, True, CurrentTime);
+  XFlush(dpy);
+  for (int i = 0; i < DRAG_STEPS; i++) {
+    XTestFakeMotionEvent(dpy, DefaultScreen(dpy), width / 4 + i * width / 2 / DRAG_STEPS, 100,
+                         CurrentTime);
+    XFlush(dpy);
+    waitFor(NULL, nowNs());
+    usleep(DRAG_STEP_US);
+  }
+  XTestFakeButtonEvent(dpy, Button1, False, CurrentTime);
+  XTestFakeKeyEvent(dpy, superKey, False, CurrentTime);
+  end();
+}
+/*
+ * Mod+Return until the terminal's window is mapped. Without a pool the stand-in terminal also
+ * reports when it was exec'd; a pooled one was started long before the key press.
+ */
+static void terminals(int iterations) {
+  XSelectInput(dpy, root, PropertyChangeMask | SubstructureNotifyMask);
+  begin(ScenarioTerminal);
+  for (int i = 0; i < iterations; i++) {
+    long start = nowNs();
+    pressKey(XK_Return, 0);
+    long ns = waitFor(&(Wait){.type = MapNotify, .foreign = 1}, start);
+    if (ns < 0) {
+      current->timeouts++;
+      continue;
+    }
+    current->samples[current->count++] = ns;
+    XTextProperty prop;
+    if (XGetTextProperty(dpy, lastForeign, &prop, benchExec)) {
+      long exec = strtol((char *)prop.value, NULL, 10) - start;
+      Scenario *spawn = &scenarios[ScenarioSpawn];
+      if (exec > 0 && spawn->count < MAX_SAMPLES) spawn->samples[spawn->count++] = exec;
+      XFree(prop.value);
+    }
+    XDestroyWindow(dpy, lastForeign);
+    XFlush(dpy);
+    usleep(TERMINAL_PAUSE_MS * 1000);
+  }
+  end();
+  XSelectInput(dpy, root, PropertyChangeMask);
+}
+static int compareLong(const void *a, const void *b) {
+  long x = *(const long *)a, y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+static double percentileUs(Scenario *s, int p) {
+  return s->count ? s->samples[(s->count - 1) * p / 100] / 1e3 : 0;
+}
+static void report(const char *label, int windowTotal, int iterations) {
+  printf("{\"label\":\"%s\",\"windows\":%d,\"iterations\":%d,\"scenarios\":{", label,
+         windowTotal, iterations);
+  for (int i = 0; i < ScenarioCount; i++) {
+    Scenario *s = &scenarios[i];
+    qsort(s->samples, s->count, sizeof(s->samples[0]), compareLong);
+    printf("%s\n\"%s\":{\"samples\":%d,\"timeouts\":%d,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+           "\"requests\":%lu,\"requests_per_op\":%.1f,\"exposes\":%lu,\"configures\":%lu",
+           i ? "," : "", s->name, s->count, s->timeouts, percentileUs(s, 50), percentileUs(s, 99),
+           s->requests, s->count ? (double)s->requests / s->count : 0, s->exposes,
+           s->configures);
+    if (i == ScenarioDrag) {
+      printf(",\"configures_per_s\":%.1f", s->ns ? s->configures * 1e9 / s->ns : 0);
+    }
+    putchar('}');
+  }
+  printf("\n}}\n");
+}
+static void waitForWm(void) {
+  long start = nowNs();
+  for (;;) {
+    Atom type;
+    int format;
+    unsigned long n, after;
+    unsigned char *data = NULL;
+    XGetWindowProperty(dpy, root, netSupportingWmCheck, 0, 1, False, XA_WINDOW, &type, &format,
+                       &n, &after, &data);
+    if (data) XFree(data);
+    if (n) return;
+    if (nowNs() - start > READY_TIMEOUT_MS * 1000000L) die("mwmp did not start");
+    usleep(10000);
+  }
+}
+/* the stand-in terminal: one window, mapped right away, gone when someone destroys it */
+static int runTerminal(void) {
+  long exec = nowNs();
+  if (!(dpy = XOpenDisplay(NULL))) return EXIT_FAILURE;
+  root       = DefaultRootWindow(dpy);
+  Window win = createWindow();
+  char text[32];
+  snprintf(text, sizeof(text), "%ld", exec);
+  XChangeProperty(dpy, win, XInternAtom(dpy, "MWMP_BENCH_EXEC", False), XA_STRING, 8,
+                  PropModeReplace, (unsigned char *)text, strlen(text));
+  long pid = getpid();
+  XChangeProperty(dpy, win, XInternAtom(dpy, "_NET_WM_PID", False), XA_CARDINAL, 32,
+                  PropModeReplace, (unsigned char *)&pid, 1);
+  XMapWindow(dpy, win);
+  XEvent e;
+  do {
+    XNextEvent(dpy, &e);
+  } while (e.type != DestroyNotify);
+  return EXIT_SUCCESS;
+}
+int main(int argc, char **argv) {
+  const char *name = strrchr(argv[0], '/');
+  if (!strcmp(name ? name + 1 : argv[0], "st")) return runTerminal();
+  int windowTotal = 20, iterations = 100, terminalIterations = 20, opt;
+  const char *label = "mwmp";
+  while ((opt = getopt(argc, argv, "p:m:n:i:t:l:")) != -1) {
+    switch (opt) {
+      case 'p':
+        wmPid = atoi(optarg);
+        break;
+      case 'm':
+        snprintf(metricsPath, sizeof(metricsPath), "%s", optarg);
+        break;
+      case 'n':
+        windowTotal = atoi(optarg);
+        break;
+      case 'i':
+        iterations = atoi(optarg);
+        break;
+      case 't':
+        terminalIterations = atoi(optarg);
+        break;
+      case 'l':
+        label = optarg;
+        break;
+      default:
+        die("usage: client -p mwmp-pid -m metrics.json [-n windows] [-i iterations] "
+            "[-t terminals] [-l label]");
+    }
+  }
+  if (wmPid <= 0 || !*metricsPath) die("mwmp's pid and metrics path are required");
+  if (windowTotal < 2 || windowTotal > MAX_WINDOWS) die("windows must be 2 to 256");
+  if (iterations * 2 > MAX_SAMPLES || terminalIterations > MAX_SAMPLES) {
+    die("too many iterations");
+  }
+  if (!(dpy = XOpenDisplay(NULL))) die("cannot open display");
+  int event, error, major, minor;
+  if (!XTestQueryExtension(dpy, &event, &error, &major, &minor)) die("no XTest extension");
+  root                 = DefaultRootWindow(dpy);
+  netCurrentDesktop    = XInternAtom(dpy, "_NET_CURRENT_DESKTOP", False);
+  netWmDesktop         = XInternAtom(dpy, "_NET_WM_DESKTOP", False);
+  netSupportingWmCheck = XInternAtom(dpy, "_NET_SUPPORTING_WM_CHECK", False);
+  benchExec            = XInternAtom(dpy, "MWMP_BENCH_EXEC", False);
+  superKey             = XKeysymToKeycode(dpy, XK_Super_L);
+  shiftKey             = XKeysymToKeycode(dpy, XK_Shift_L);
+  XModifierKeymap *mods = XGetModifierMapping(dpy);
+  _Bool superIsMod4     = 0;
+  for (int i = 0; i < mods->max_keypermod; i++) {
+    if (mods->modifiermap[Mod4MapIndex * mods->max_keypermod + i] == superKey) superIsMod4 = 1;
+  }
+  XFreeModifiermap(mods);
+  if (!superKey || !superIsMod4) die("Super_L is not on Mod4");
+  waitForWm();
+  XSelectInput(dpy, root, PropertyChangeMask);
+  mapWindows(windowTotal);
+  focusWindows(iterations);
+  switchDesktops(iterations);
+  moveWindows(iterations);
+  unmapWindows(iterations);
+  drag();
+  terminals(terminalIterations);
+  destroyWindows();
+  report(label, windowTotal, iterations);
+  XCloseDisplay(dpy);
+  return EXIT_SUCCESS;
+}
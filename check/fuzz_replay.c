@@ -0,0 +1,31 @@
+/*
+ * make fuzz: libFuzzer writes mwmp -r traces, one event per line, and every event is run
+ * through the window model with the invariants checked after it, as in the second pass of
+ * mwmp -r. A broken invariant aborts with the event that broke it.
+ */
+#define main mwmpMain
+#include "../main.c"
+#undef main
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  char line[256];
+  startReplay();
+  for (size_t i = 0; i < size; i++) {
+    size_t len = 0;
+    for (; i < size && data[i] != '\n'; i++) {
+      if (len < sizeof(line) - 1) line[len++] = data[i];
+    }
+    line[len] = '\0';
+    ReplayEvent ev;
+    if (parseReplayEvent(line, &ev) <= 0) continue;
+    replayEvent(&ev);
+    const char *error = checkEvent(&ev);
+    if (error) {
+      fprintf(stderr, "fuzz: %s after \"%s\"\n", error, line);
+      abort();
+    }
+    if (ev.type == REPLAY_QUIT) break;
+  }
+  cleanupCore();
+  return 0;
+}
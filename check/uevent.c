@@ -0,0 +1,112 @@
+/*
+ * make check: the battery module against a fake power_supply tree and uevents sent through a
+ * socketpair instead of the kernel's netlink socket. Built with POWER_SUPPLY_DIR pointing at a
+ * relative "power_supply", which is created in a temporary directory.
+ */
+#define main mwmpMain
+#include "../main.c"
+#undef main
+#include <sys/stat.h>
+
+static int failures;
+
+static void writeFile(const char *path, const char *text) {
+  FILE *f = fopen(path, "w");
+  if (!f) die("cannot write the fake power_supply tree");
+  fputs(text, f);
+  fclose(f);
+}
+static void addSupply(const char *name, const char *type, const char *capacity,
+                      const char *status) {
+  char path[256];
+  snprintf(path, sizeof(path), POWER_SUPPLY_DIR "/%s", name);
+  mkdir(path, 0700);
+  snprintf(path, sizeof(path), POWER_SUPPLY_DIR "/%s/type", name);
+  writeFile(path, type);
+  if (!capacity) return;
+  snprintf(path, sizeof(path), POWER_SUPPLY_DIR "/%s/capacity", name);
+  writeFile(path, capacity);
+  snprintf(path, sizeof(path), POWER_SUPPLY_DIR "/%s/status", name);
+  writeFile(path, status);
+}
+static void removeSupply(const char *name) {
+  const char *files[] = {"type", "capacity", "status"};
+  char path[256];
+  for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+    snprintf(path, sizeof(path), POWER_SUPPLY_DIR "/%s/%s", name, files[i]);
+    unlink(path);
+  }
+  snprintf(path, sizeof(path), POWER_SUPPLY_DIR "/%s", name);
+  rmdir(path);
+}
+/* a uevent datagram: "action@devpath" followed by the KEY=VALUE fields, all NUL separated */
+static void sendUevent(int fd, const char *action, const char *subsystem) {
+  char buf[256];
+  int len = snprintf(buf, sizeof(buf), "%s@/devices/fake", action) + 1;
+  len += snprintf(buf + len, sizeof(buf) - len, "ACTION=%s", action) + 1;
+  len += snprintf(buf + len, sizeof(buf) - len, "SUBSYSTEM=%s", subsystem) + 1;
+  if (send(fd, buf, len, 0) != len) die("cannot send uevent");
+}
+static void expect(const char *what, _Bool ok) {
+  if (ok) return;
+  fprintf(stderr, "check: %s\n", what);
+  failures++;
+}
+static const char *batteryText(void) {
+  refreshModules(updateBattery);
+  for (size_t i = 0; i < MODULE_COUNT; i++) {
+    if (modules[i].update == updateBattery) return modules[i].text;
+  }
+  return "";
+}
+int main(void) {
+  char dir[] = "/tmp/mwmp-check-XXXXXX";
+  if (!mkdtemp(dir) || chdir(dir) < 0) die("cannot create a temporary directory");
+  mkdir(POWER_SUPPLY_DIR, 0700);
+  addSupply("AC", "Mains\n", NULL, NULL);
+  addSupply("BAT0", "Battery\n", "57\n", "Discharging\n");
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0, sv) < 0) die("cannot create socketpair");
+  _Bool rescan = 0;
+
+  scanBatteries();
+  expect("only the battery is tracked", batteryCount == 1);
+  expect("discharging battery text", strcmp(batteryText(), "b: 57% (dis)") == 0);
+
+  addSupply("BAT0", "Battery\n", "58\n", "Charging\n");
+  sendUevent(sv[1], "change", "power_supply");
+  expect("change uevent is seen", readUevents(sv[0], &rescan));
+  expect("change uevent needs no rescan", !rescan);
+  expect("open fds read the new values", strcmp(batteryText(), "b: 58% (char)") == 0);
+
+  sendUevent(sv[1], "change", "usb");
+  expect("other subsystems are ignored", !readUevents(sv[0], &rescan));
+
+  addSupply("BAT1", "Battery\n", "100\n", "Full\n");
+  sendUevent(sv[1], "change", "usb");
+  sendUevent(sv[1], "add", "power_supply");
+  expect("add uevent behind another one is seen", readUevents(sv[0], &rescan));
+  expect("add uevent asks for a rescan", rescan);
+  scanBatteries();
+  expect("added battery is tracked", batteryCount == 2);
+  expect("both batteries in the text", strstr(batteryText(), "b: 100%") != NULL);
+
+  removeSupply("BAT1");
+  rescan = 0;
+  sendUevent(sv[1], "remove", "power_supply");
+  expect("remove uevent asks for a rescan", readUevents(sv[0], &rescan) && rescan);
+  scanBatteries();
+  expect("removed battery is dropped", batteryCount == 1);
+  expect("remaining battery text", strcmp(batteryText(), "b: 58% (char)") == 0);
+
+  closeBatteries();
+  close(sv[0]);
+  close(sv[1]);
+  removeSupply("BAT0");
+  removeSupply("AC");
+  rmdir(POWER_SUPPLY_DIR);
+  rmdir(dir);
+  if (failures) return EXIT_FAILURE;
+  puts("check: uevent and battery ok");
+  return EXIT_SUCCESS;
+}
@@ -1,53 +1,338 @@
+#define _GNU_SOURCE
 #include <X11/XF86keysym.h>
-#include <X11/XKBlib.h>
+#include <X11/Xatom.h>
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
 #include <X11/keysym.h>
+#ifdef USE_XRANDR
+#include <X11/extensions/Xrandr.h>
+#endif
+#include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/netlink.h>
+#include <poll.h>
 #include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/statvfs.h>
-#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #define STATUS_BAR_HEIGHT 20
 #define RESIZE_STEP 50
 #define MAX_DESKTOPS 9
-#define MAX_WINDOWS_PER_DESKTOP 6
 #define MOD_KEY Mod4Mask
 #define GAP_SIZE 10
 #define BORDER_WIDTH 1
 #define COLOR_A 0xFFFFFF
 #define COLOR_B 0x000000
+#ifndef POWER_SUPPLY_DIR
+#define POWER_SUPPLY_DIR "/sys/class/power_supply"
+#endif
+#define MAX_BATTERIES 4
+#define CLIENT_SLAB_SIZE 64
+#define SHELL_CHARS "\"'\\$`&|;<>(){}[]*?~#=!\n"
+#define MAX_SPAWN_ARGS 32
+#define OSD_SOCKET_NAME "mwmp-%s-osd.sock" /* %s is $DISPLAY, so each X session has its own */
+#define OSD_TIMEOUT_MS 1000
+#define CTL_SOCKET_NAME "mwmp-%s-ctl.sock"
+#define CTL_MESSAGE_SIZE 4096
+#define CTL_MAX_BATCH 64
+#define CTL_TIMEOUT_MS 1000
+#define OSD_WIDTH 200
+#define METRICS_FILE_NAME "mwmp-metrics.json"
+#define TRACE_FILE_NAME "mwmp-trace.json"
+#define TRACE_SIZE 4096 /* power of two, the oldest entries are overwritten */
+#define HIST_BUCKETS 24 /* bucket i holds times in [2^(i-1), 2^i) microseconds, 0 is < 1 us */
+#ifndef PARK_HIDDEN
+#define PARK_HIDDEN 1 /* 0 unmaps windows on hidden desktops instead of parking them off-screen */
+#endif
+#define MODULE_TEXT_SIZE 32
+#define WHEEL_SLOTS 64 /* seconds covered by one turn of the module timer wheel */
+#define FRAME_RATE 60 /* a drag reconfigures windows at most this many times per second */
+#define FRAME_NS (1000000000L / FRAME_RATE)
+#define CLIENT_INDEX_MIN 64 /* power of two; doubled whenever it gets half full */
+#define TERMINAL "st"
+#ifndef TERMINAL_POOL
+#define TERMINAL_POOL 0 /* terminals kept started but unmapped for Mod+Return, 0 disables */
+#endif
+#define POOL_MAX_FAILURES 3 /* stop refilling after this many pool terminals die unused */
+#define OP_QUEUE 256        /* queued X requests; a full queue is applied before the flush */
+#define REPLAY_WIDTH 1920   /* screen size for mwmp -r until the trace has a screen line */
+#define REPLAY_HEIGHT 1080
+#define MAX_MONITORS 4 /* at most MAX_DESKTOPS, each monitor shows a desktop of its own */
+#define MIN_MONITOR_SIZE 40 /* mwmp -r rejects screens that split into smaller monitors */
 
 typedef struct {
   KeySym keysym;
   const char *command;
 } AppLauncher;
-static const AppLauncher launchers[] = {{XK_Return, "st"},
-                                        {XK_p,
+static const AppLauncher launchers[] = {{XK_p,
                                          "dmenu_run -m '0' -nb '#000000' -nf '#ffffff' -sb "
                                          "'#ffffff' -sf '#000000'"},
                                         {XF86XK_AudioRaiseVolume, AUDIO_SCRIPT " +"},
                                         {XF86XK_AudioLowerVolume, AUDIO_SCRIPT " -"},
                                         {XF86XK_AudioMicMute, AUDIO_SCRIPT " mic"},
                                         {XF86XK_AudioMute, AUDIO_SCRIPT " aud"}};
+#define LAUNCHER_COUNT (sizeof(launchers) / sizeof(launchers[0]))
+typedef union {
+  int i;
+  const char *cmd;
+} Arg;
 typedef struct {
-  Window windows[MAX_WINDOWS_PER_DESKTOP];
-  unsigned char windowCount;
-  unsigned char focusedIdx;
-  _Bool isMapped[MAX_WINDOWS_PER_DESKTOP];
+  unsigned int mod;
+  KeySym keysym;
+  void (*func)(const Arg *);
+  Arg arg;
+} Key;
+static void keyQuit(const Arg *arg);
+static void keyRestart(const Arg *arg);
+static void keyResize(const Arg *arg);
+static void keyKill(const Arg *arg);
+static void keyFocus(const Arg *arg);
+static void keyView(const Arg *arg);
+static void keyMove(const Arg *arg);
+static void keySpawn(const Arg *arg);
+static void keyTerminal(const Arg *arg);
+static void keyMonitor(const Arg *arg);
+static const Key keys[] = {{MOD_KEY, XK_Return, keyTerminal, {.cmd = TERMINAL}},
+                           {MOD_KEY | ShiftMask, XK_q, keyQuit, {0}},
+                           {MOD_KEY | ShiftMask, XK_r, keyRestart, {0}},
+                           {MOD_KEY | ShiftMask, XK_h, keyResize, {.i = -RESIZE_STEP}},
+                           {MOD_KEY | ShiftMask, XK_l, keyResize, {.i = RESIZE_STEP}},
+                           {MOD_KEY, XK_q, keyKill, {0}},
+                           {MOD_KEY, XK_j, keyFocus, {.i = 1}},
+                           {MOD_KEY, XK_k, keyFocus, {.i = -1}},
+                           {MOD_KEY, XK_period, keyMonitor, {.i = 1}},
+                           {MOD_KEY, XK_comma, keyMonitor, {.i = -1}}};
+#define KEY_COUNT (sizeof(keys) / sizeof(keys[0]))
+typedef struct Module Module;
+struct Module {
+  void (*update)(Module *m);
+  unsigned short interval;    /* seconds between updates, 0 for modules refreshed by events */
+  const char *source;         /* opened once and read with pread, NULL if unused */
+  int fd;                     /* -1 until opened */
+  unsigned long long prev[2]; /* counters kept between samples */
+  unsigned short rounds;      /* wheel turns left before the module is due */
+  Module *nextDue;            /* next module in the same wheel slot */
+  char text[MODULE_TEXT_SIZE];
+};
+static void updateClock(Module *m);
+static void updateBattery(Module *m);
+static void updateCpu(Module *m);
+static void updateMemory(Module *m);
+static void updateDisk(Module *m);
+static void updateLoad(Module *m);
+static void updateDesktop(Module *m);
+/* drawn left to right, separated by " | " */
+static Module modules[] = {
+    {.update = updateClock, .interval = 1, .fd = -1},
+    {.update = updateBattery, .interval = 60, .fd = -1},
+    {.update = updateCpu, .interval = 2, .source = "/proc/stat", .fd = -1},
+    {.update = updateMemory, .interval = 5, .source = "/proc/meminfo", .fd = -1},
+    {.update = updateDisk, .interval = 60, .source = "/", .fd = -1},
+    {.update = updateLoad, .interval = 5, .source = "/proc/loadavg", .fd = -1},
+    {.update = updateDesktop, .interval = 0, .fd = -1}};
+#define MODULE_COUNT (sizeof(modules) / sizeof(modules[0]))
+/* floating windows keep their own geometry above the tiles, ignored ones are never managed */
+enum { RULE_FLOATING = 1, RULE_IGNORE = 2 };
+typedef struct {
+  const char *windowClass; /* WM_CLASS class, NULL matches any */
+  const char *instance;    /* WM_CLASS instance, NULL matches any */
+  const char *title;       /* substring of WM_NAME, NULL matches any */
+  const char *type;        /* _NET_WM_WINDOW_TYPE atom name, NULL matches any */
+  unsigned char desktop;   /* 1-based target desktop, 0 for the current one */
+  unsigned char flags;     /* RULE_FLOATING, RULE_IGNORE */
+} Rule;
+/* the first matching rule wins, e.g. {.windowClass = "firefox", .desktop = 2} */
+static const Rule rules[] = {{.type = "_NET_WM_WINDOW_TYPE_DIALOG", .flags = RULE_FLOATING},
+                             {.type = "_NET_WM_WINDOW_TYPE_UTILITY", .flags = RULE_FLOATING},
+                             {.type = "_NET_WM_WINDOW_TYPE_SPLASH", .flags = RULE_FLOATING}};
+#define RULE_COUNT (sizeof(rules) / sizeof(rules[0]))
+#define RULE_BUCKETS 64 /* power of two; rules hash by class, class-less ones share one chain */
+/* keys[], then Mod(+Shift)+digit per desktop, then launchers[]; indexed from keyTable */
+static Key bindings[KEY_COUNT + 2 * MAX_DESKTOPS + LAUNCHER_COUNT];
+static unsigned char bindingCount;
+static unsigned char keyTable[256][16]; /* [keycode][modIndex()] -> bindings[] index + 1 */
+static unsigned int numlockMask;
+extern char **environ;
+static posix_spawnattr_t spawnAttr;
+static posix_spawn_file_actions_t spawnActions;
+typedef struct {
+  int x, y, w, h;
+  int borderWidth;
+  unsigned long borderColor;
+  _Bool mapped;
+  unsigned char wmState; /* ICCCM WM_STATE, WithdrawnState until first shown or hidden */
+} WinState;
+typedef struct Client Client;
+struct Client {
+  Window win;
+  Client *prev, *next; /* desktop order; next doubles as the free-list link */
+  unsigned char desktop;
+  _Bool canDelete; /* advertises WM_DELETE_WINDOW in WM_PROTOCOLS */
+  WinState want;   /* filled by layout and focus code */
+  WinState have;   /* what the server was last told */
+  unsigned char ignoreUnmap;
+  XRectangle floatGeometry; /* width 0 for tiled clients */
+  _Bool raised;             /* floating and not covered by a window mapped after it */
+};
+typedef struct {
+  Client *head, *tail;
+  Client *focused;
+  unsigned int windowCount;
 } Desktop;
+enum {
+  WMProtocols,
+  WMDelete,
+  WMState,
+  MwmpState,
+  Utf8String,
+  NetWMPid,
+  NetWMWindowType,
+  NetSupported, /* first EWMH atom, everything from here on is listed in _NET_SUPPORTED */
+  NetSupportingWMCheck,
+  NetWMName,
+  NetClientList,
+  NetNumberOfDesktops,
+  NetCurrentDesktop,
+  NetActiveWindow,
+  NetWMDesktop,
+  AtomCount
+};
+static char *atomNames[AtomCount] = {"WM_PROTOCOLS",
+                                     "WM_DELETE_WINDOW",
+                                     "WM_STATE",
+                                     "_MWMP_STATE",
+                                     "UTF8_STRING",
+                                     "_NET_WM_PID",
+                                     "_NET_WM_WINDOW_TYPE",
+                                     "_NET_SUPPORTED",
+                                     "_NET_SUPPORTING_WM_CHECK",
+                                     "_NET_WM_NAME",
+                                     "_NET_CLIENT_LIST",
+                                     "_NET_NUMBER_OF_DESKTOPS",
+                                     "_NET_CURRENT_DESKTOP",
+                                     "_NET_ACTIVE_WINDOW",
+                                     "_NET_WM_DESKTOP"};
+/*
+ * _MWMP_STATE is resizeDelta, the current desktop and SAVED_FIELDS, then per client: window,
+ * desktop, flags, the floating geometry and the geometry the server has. Older instances wrote
+ * 7 fields, or no field count and only the first three; a window id is never as small as
+ * SAVED_FIELDS, so they are told apart.
+ */
+enum { SAVED_FOCUSED = 1, SAVED_CAN_DELETE = 2, SAVED_FLOATING = 4, SAVED_MAPPED = 8 };
+#define SAVED_FIELDS 12
+static Atom atoms[AtomCount];
 static Display *dpy;
 static Window root;
+static Window inputFocus = None; /* last focus we set or saw in a FocusIn */
 static Desktop desktops[MAX_DESKTOPS];
+static Client **clientSlabs;
+static size_t clientSlabCount;
+static Client *freeClients;
+static Client **clientIndex; /* open addressing, keyed by Client.win, NULL marks an empty bucket */
+static size_t clientIndexSize, clientIndexUsed;
 static unsigned char currentDesktop  = 0;
 static volatile sig_atomic_t running = 1;
+static _Bool restarting; /* re-exec after cleanup, leaving windows mapped for the new instance */
 static unsigned short screen_width, screen_height;
+typedef struct {
+  XRectangle area;       /* output geometry, re-read only when RandR reports a change */
+  unsigned char desktop; /* no two monitors show the same desktop */
+} Monitor;
+static Monitor monitors[MAX_MONITORS];
+static unsigned char monitorCount = 1;
+static unsigned char currentMonitor; /* currentDesktop is always monitors[currentMonitor].desktop */
+static int randrEventBase = -1; /* stays -1 without RandR 1.5, the root is then the only monitor */
+static _Bool monitorsDirty;     /* RandR reported a change, re-read once the queue is drained */
+enum {
+  POLL_X,
+  POLL_TIMER,
+  POLL_SIGNAL,
+  POLL_UEVENT,
+  POLL_OSD,
+  POLL_OSD_TIMER,
+  POLL_FRAME,
+  POLL_CTL,
+  POLL_COUNT
+};
+static struct pollfd pollfds[POLL_COUNT];
+typedef struct {
+  int capacityFd;
+  int statusFd;
+} Battery;
+static Battery batteries[MAX_BATTERIES];
+static unsigned char batteryCount;
+static Module *wheel[WHEEL_SLOTS];
+static time_t wheelTime;  /* last second the wheel was advanced to */
+static _Bool barDirty = 1; /* some module text changed since the bar was drawn */
+static const WinState unknownState = {INT_MIN, INT_MIN, 0, 0, -1, ~0UL, 0, WithdrawnState};
+#ifdef DEBUG_ROUNDTRIPS
+static unsigned long roundTrips[LASTEvent];
+static int currentEvent;
+#define ROUNDTRIP(call) (roundTrips[currentEvent]++, (call))
+#else
+#define ROUNDTRIP(call) (call)
+#endif
+typedef struct {
+  unsigned long events[LASTEvent];
+  unsigned long eventRequests[LASTEvent];
+  unsigned long eventTimes[LASTEvent][HIST_BUCKETS];
+  unsigned long bursts; /* event queue drains that handled at least one event */
+  unsigned long layoutRequests;
+  unsigned long relayouts;
+  unsigned long configures;
+  unsigned long motionsDropped; /* MotionNotify events compressed away during drags */
+  unsigned long errors[256];
+  unsigned long barRedraws;
+  unsigned long barTimes[HIST_BUCKETS];
+} Metrics;
+static Metrics metrics;
+typedef struct {
+  long startNs; /* CLOCK_MONOTONIC */
+  unsigned int durationNs;
+  unsigned short requests;
+  unsigned char type;    /* event type, 0 for an X error */
+  unsigned char detail;  /* error code for X errors */
+  unsigned char request; /* failed request opcode for X errors */
+  unsigned char desktopBefore, desktopAfter;
+  unsigned short windowCount; /* on the current desktop after the handler ran */
+  Window window;
+  Window focusBefore, focusAfter;
+} TraceEntry;
+static TraceEntry trace[TRACE_SIZE];
+static unsigned long traceCount; /* entries ever recorded, trace[traceCount % TRACE_SIZE] is next */
+/* 1 is a reply, never an event type, so it accounts for the requests layout flushes send */
+#define FlushEvent 1
+static const char *eventNames[LASTEvent] = {
+    [FlushEvent] = "Flush",              [KeyPress] = "KeyPress",
+    [MapRequest] = "MapRequest",         [MapNotify] = "MapNotify",
+    [UnmapNotify] = "UnmapNotify",       [DestroyNotify] = "DestroyNotify",
+    [ConfigureNotify] = "ConfigureNotify", [Expose] = "Expose",
+    [FocusIn] = "FocusIn",               [PropertyNotify] = "PropertyNotify",
+    [MappingNotify] = "MappingNotify",   [ClientMessage] = "ClientMessage",
+    [ButtonPress] = "ButtonPress",       [ButtonRelease] = "ButtonRelease",
+    [MotionNotify] = "MotionNotify"};
+#ifdef DEBUG_WAKEUPS
+static unsigned long wakeups;
+static time_t wakeupsSince;
+#endif
 static void setup(void);
 static void run(void);
+static void recordEvent(int type, Window win, const struct timespec *start,
+                        unsigned long firstRequest, unsigned char desktopBefore,
+                        Window focusBefore);
+static void recordFlush(void);
 static void cleanup(void);
 static void handleKeyPress(XEvent *e);
 static void handleMapRequest(XEvent *e);
@@ -56,87 +341,1061 @@ static void handleDestroyNotify(XEvent *e);
 static void handleConfigureNotify(XEvent *e);
 inline static void focusWindow(Window w);
 static void tileWindows(void);
+static void tileMonitor(const Monitor *m);
+static int splitMargin(int width);
+static inline void markLayoutDirty(void);
+static void flushLayout(void);
 static void switchDesktop(int desktop);
 static void moveWindowToDesktop(Window win, unsigned char desktop);
 static void grabKeys(void);
-static void sigHandler(int);
+static void setupBindings(void);
+static void handleMappingNotify(XEvent *e);
+static void setupPollFds(void);
+static void armModuleTimer(void);
+static void setupModules(void);
+static void advanceModules(void);
+static void refreshModules(void (*update)(Module *m));
+static void closeModules(void);
+static void scanBatteries(void);
+static _Bool readUevents(int fd, _Bool *rescan);
+static void handleUevent(void);
+static void drawStatusBar(void);
+static void setupStatusBar(void);
+static void resizeStatusBar(void);
+static void handleExpose(XEvent *e);
+static void setupOsd(void);
+static void handleOsdMessage(void);
+static void drawOsd(void);
+static void setupControl(void);
+static void handleControlMessage(void);
 static int xerrorstart(Display *, XErrorEvent *);
 static int xerror(Display *, XErrorEvent *);
+static inline Window modelFocus(void);
+static inline long elapsedNs(const struct timespec *start);
+static inline void recordTime(unsigned long *hist, long ns);
+static void dumpMetrics(void);
+static void dumpTrace(void);
 static void killFocusedWindow(void);
 static void focusCycleWindow(int);
-static void handleMapNotify(XEvent *e);
+static pid_t spawn(const char *cmd);
+static void refillPool(void);
+static _Bool claimForPool(Window win);
+static void releasePool(pid_t pid, Window win);
+static void setupSpawn(void);
+static void handleFocusIn(XEvent *e);
+static void handlePropertyNotify(XEvent *e);
+static void handleClientMessage(XEvent *e);
+static void handleButtonPress(XEvent *e);
+static void handleButtonRelease(XEvent *e);
+static void handleMotionNotify(XEvent *e);
+static void applyDrag(void);
+static void setupEwmh(void);
+static void publishEwmh(void);
+static void updateProtocols(Client *c);
 inline static void die(const char *msg);
-static inline int detachWindow(Window w, Window *windows, unsigned char *windowCount,
-                               unsigned char *focusedIdx, _Bool *isMapped);
+static void attachClient(Client *c, unsigned char desktop);
+static void detachClient(Client *c);
+static Client *findClient(Window w);
+static inline size_t clientHash(Window w, size_t size);
+static void indexClient(Client *c);
+static void unindexClient(Client *c);
+static void unmanageClient(Client *c);
+static Client *manageClient(Window win, unsigned char desktop);
+static void mapWindowToDesktop(Window win, const XWindowAttributes *wa);
+static void placeFloating(Client *c);
+static void setFloating(Client *c, int x, int y, unsigned int w, unsigned int h);
+static void compileRules(void);
+static const Rule *matchRule(Window win);
+static void adoptWindows(void);
+static void restoreState(const unsigned long *saved, unsigned long n, const Window *windows,
+                         unsigned int count, void (*fetch)(Client *c));
+static void releaseClients(void);
+static long *stateData(size_t *n);
+static int compareWindows(const void *a, const void *b);
+static void commitClient(Client *c);
+static void hideClient(Client *c);
+static void showNewClient(Client *c);
+static void hideDesktop(unsigned char desktop);
+static int monitorOf(unsigned char desktop);
+static int monitorAt(int x, int y);
+static void focusMonitor(int monitor);
+static void setMonitors(const XRectangle *areas, int count);
+static void setupMonitors(void);
+static void updateMonitors(void);
+static void withdrawClient(Window win);
+static void setupCore(void);
+static void cleanupCore(void);
+static int replayTrace(const char *path);
+static int generateTrace(unsigned long count, unsigned int seed);
+static int compareLong(const void *a, const void *b);
 static char previousStatus[256] = "";
+static Window bars[MAX_MONITORS]; /* bars[0] doubles as the _NET_SUPPORTING_WM_CHECK window */
+static unsigned char barCount;
+static Pixmap barBuf;
+static GC barGC;
+static XFontStruct *barFont;
+static Window osdWin;
+static char osdText[64];
+static int osdLevel = -1; /* 0-100 draws a level bar under the text */
+static struct sockaddr_un osdAddr;
+static struct sockaddr_un ctlAddr;
+/* handlers only mark these; flushLayout applies them once per drained event queue */
+static _Bool layoutDirty, focusDirty, serverGrabbed;
+enum { ARG_NONE, ARG_DIRECTION, ARG_NUMBER };
+typedef struct {
+  const char *name;
+  void (*func)(const Arg *);
+  unsigned char argType; /* ARG_DIRECTION takes next or prev */
+  int min, max;          /* accepted range of an ARG_NUMBER */
+} Command;
+static void ctlMove(const Arg *arg);
+static void ctlView(const Arg *arg);
+static const Command commands[] = {{"focus", keyFocus, ARG_DIRECTION, 0, 0},
+                                   {"view", ctlView, ARG_NUMBER, 1, MAX_DESKTOPS},
+                                   {"move", ctlMove, ARG_NUMBER, 1, MAX_DESKTOPS},
+                                   {"resize", keyResize, ARG_NUMBER, -SHRT_MAX, SHRT_MAX},
+                                   {"monitor", keyMonitor, ARG_DIRECTION, 0, 0},
+                                   {"kill", keyKill, ARG_NONE, 0, 0},
+                                   {"restart", keyRestart, ARG_NONE, 0, 0},
+                                   {"query", NULL, ARG_NONE, 0, 0}};
+#define COMMAND_COUNT (sizeof(commands) / sizeof(commands[0]))
 static short resizeDelta        = 0;
-int main(void) {
-  signal(SIGTERM, sigHandler);
-  signal(SIGINT, sigHandler);
+/* last values written to the root EWMH properties, compared once per flush */
+static int publishedDesktop     = -1;
+static Window publishedActive   = None;
+static _Bool clientListDirty;
+static _Bool dragging;
+static int dragX = -1;  /* newest pointer x not yet applied to the split, -1 if none */
+static int dragMonitor; /* the monitor the drag started on, the split is measured from its centre */
+static struct timespec lastFrame;
+/*
+ * The window model (desktops, layout, focus) never calls Xlib itself. It queues XOps that
+ * applyOps() sends once per flush, so mwmp -r can replay an event trace through the same code
+ * with the ops only counted.
+ */
+enum {
+  OP_CONFIGURE,
+  OP_BORDER,
+  OP_MAP,
+  OP_UNMAP,
+  OP_WM_STATE,
+  OP_DESKTOP,  /* _NET_WM_DESKTOP */
+  OP_MANAGE,   /* select client events and append to _NET_CLIENT_LIST */
+  OP_WITHDRAW, /* drop WM_STATE and _NET_WM_DESKTOP once the client unmapped itself */
+  OP_CLOSE,    /* WM_DELETE_WINDOW */
+  OP_KILL,
+  OP_RAISE,
+  OP_FOCUS,
+  OP_GRAB, /* released by flushLayout after the bar and EWMH properties are updated */
+  OP_COUNT
+};
+typedef struct {
+  unsigned char type;
+  unsigned int mask; /* CW* bits of wc for OP_CONFIGURE */
+  Window win;
+  long value; /* border pixel, WM_STATE or desktop */
+  XWindowChanges wc;
+} XOp;
+static XOp ops[OP_QUEUE];
+static unsigned int opCount;
+static _Bool replaying;                  /* ops are counted instead of sent */
+static unsigned long opTotals[OP_COUNT]; /* per type, only while replaying */
+static const char *opNames[OP_COUNT] = {"configure", "border", "map",      "unmap", "wm_state",
+                                        "desktop",   "manage", "withdraw", "close", "kill",
+                                        "raise",     "focus",  "grab"};
+enum {
+  REPLAY_COMMAND,
+  REPLAY_MAP,
+  REPLAY_UNMAP,
+  REPLAY_DESTROY,
+  REPLAY_SCREEN,
+  REPLAY_SPLIT, /* into this many monitors side by side */
+  REPLAY_FLUSH,
+  REPLAY_FLOAT,   /* map a floating window */
+  REPLAY_RESTART, /* through _MWMP_STATE, as keyRestart */
+  REPLAY_QUIT     /* ends the trace, as keyQuit */
+};
+static const char *replayNames[] = {NULL,    "map",   "unmap", "destroy", "screen",
+                                    "split", "flush", "float", "restart", "quit"};
+typedef struct {
+  unsigned char type;
+  const Command *command; /* REPLAY_COMMAND */
+  Arg arg;
+  unsigned long a, b; /* window, screen width and height or monitor count */
+  unsigned long line;
+} ReplayEvent;
+static void queueOp(XOp op);
+static void applyOps(void);
+typedef struct {
+  pid_t pid;  /* 0 for an empty slot */
+  Window win; /* None until the terminal asks to be mapped */
+} PoolSlot;
+static PoolSlot pool[TERMINAL_POOL ? TERMINAL_POOL : 1];
+static unsigned char poolFailures;
+enum { NEED_CLASS = 1, NEED_TITLE = 2, NEED_TYPE = 4 };
+static unsigned char ruleBuckets[RULE_BUCKETS + 1]; /* first rule index + 1 per chain */
+static unsigned char ruleNext[RULE_COUNT];          /* next rule index + 1 in the same chain */
+static Atom ruleTypes[RULE_COUNT];
+static unsigned char ruleNeeds; /* properties any rule looks at */
+static int runtimePath(char *path, size_t size, const char *name) {
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  int len;
+  if (dir) {
+    len = snprintf(path, size, "%s/%s", dir, name);
+  } else {
+    len = snprintf(path, size, "/tmp/%u-%s", getuid(), name);
+  }
+  return len > 0 && (size_t)len < size;
+}
+static int socketAddress(struct sockaddr_un *addr, const char *format) {
+  char name[sizeof(addr->sun_path)];
+  const char *display = getenv("DISPLAY");
+  int len             = snprintf(name, sizeof(name), format, display ? display : "");
+  if (len < 0 || (size_t)len >= sizeof(name)) return 0;
+  for (char *p = name; *p; p++) {
+    if (*p == '/') *p = '_';
+  }
+  addr->sun_family = AF_UNIX;
+  return runtimePath(addr->sun_path, sizeof(addr->sun_path), name);
+}
+static int sendControl(const char *msg) {
+  struct sockaddr_un addr = {0};
+  struct timeval timeout  = {CTL_TIMEOUT_MS / 1000, (CTL_TIMEOUT_MS % 1000) * 1000};
+  char reply[CTL_MESSAGE_SIZE];
+  int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (fd < 0) return EXIT_FAILURE;
+  if (!socketAddress(&addr, CTL_SOCKET_NAME)) {
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  /* autobind to an abstract address so the reply has somewhere to go */
+  sa_family_t family = AF_UNIX;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  if (bind(fd, (struct sockaddr *)&family, sizeof(family)) < 0 ||
+      sendto(fd, msg, strlen(msg), 0, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  ssize_t n = recv(fd, reply, sizeof(reply), 0);
+  close(fd);
+  if (n <= 0) return EXIT_FAILURE;
+  fwrite(reply, 1, n, stdout);
+  return strncmp(reply, "ok", 2) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+static int sendMessage(int argc, char **argv) {
+  /* mwmp -m text | mwmp -l level text | mwmp -c commands */
+  char msg[sizeof(osdText) + 8];
+  if (argc == 3 && strcmp(argv[1], "-c") == 0) {
+    return sendControl(argv[2]);
+  } else if (argc == 3 && strcmp(argv[1], "-m") == 0) {
+    snprintf(msg, sizeof(msg), "-1 %s", argv[2]);
+  } else if (argc == 4 && strcmp(argv[1], "-l") == 0) {
+    snprintf(msg, sizeof(msg), "%d %s", atoi(argv[2]), argv[3]);
+  } else {
+    fprintf(stderr,
+            "usage: mwmp [-m text | -l level text | -c commands | -r trace | -g count [seed]]\n");
+    return EXIT_FAILURE;
+  }
+  struct sockaddr_un addr = {0};
+  int fd                  = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (fd < 0) return EXIT_FAILURE;
+  if (!socketAddress(&addr, OSD_SOCKET_NAME)) {
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  ssize_t n = sendto(fd, msg, strlen(msg), 0, (struct sockaddr *)&addr, sizeof(addr));
+  close(fd);
+  return n < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+int main(int argc, char **argv) {
+  if (argc == 3 && strcmp(argv[1], "-r") == 0) return replayTrace(argv[2]);
+  if ((argc == 3 || argc == 4) && strcmp(argv[1], "-g") == 0) {
+    return generateTrace(strtoul(argv[2], NULL, 10), argc == 4 ? atoi(argv[3]) : 1);
+  }
+  if (argc > 1) return sendMessage(argc, argv);
   setup();
   run();
   cleanup();
+  if (restarting) {
+    execvp(argv[0], argv);
+    die("cannot restart");
+  }
+  return EXIT_SUCCESS;
+}
+static int readSysfs(int fd, char *buf, size_t size) {
+  ssize_t n = pread(fd, buf, size - 1, 0);
+  if (n <= 0) {
+    buf[0] = '\0';
+    return 0;
+  }
+  while (n > 0 && buf[n - 1] == '\n') n--;
+  buf[n] = '\0';
+  return 1;
 }
-static char *getCurrentTime() {
-  static char timeStr[9];
-  time_t t = time(NULL);
+static void closeBatteries(void) {
+  for (unsigned char i = 0; i < batteryCount; i++) {
+    close(batteries[i].capacityFd);
+    close(batteries[i].statusFd);
+  }
+  batteryCount = 0;
+}
+static void scanBatteries(void) {
+  closeBatteries();
+  DIR *dir = opendir(POWER_SUPPLY_DIR);
+  if (!dir) return;
+  struct dirent *ent;
+  char path[512], type[16];
+  while ((ent = readdir(dir)) && batteryCount < MAX_BATTERIES) {
+    if (ent->d_name[0] == '.') continue;
+    snprintf(path, sizeof(path), POWER_SUPPLY_DIR "/%s/type", ent->d_name);
+    int typeFd = open(path, O_RDONLY | O_CLOEXEC);
+    if (typeFd < 0) continue;
+    int isBattery = readSysfs(typeFd, type, sizeof(type)) && strcmp(type, "Battery") == 0;
+    close(typeFd);
+    if (!isBattery) continue;
+    snprintf(path, sizeof(path), POWER_SUPPLY_DIR "/%s/capacity", ent->d_name);
+    int capacityFd = open(path, O_RDONLY | O_CLOEXEC);
+    snprintf(path, sizeof(path), POWER_SUPPLY_DIR "/%s/status", ent->d_name);
+    int statusFd = open(path, O_RDONLY | O_CLOEXEC);
+    if (capacityFd < 0 || statusFd < 0) {
+      if (capacityFd >= 0) close(capacityFd);
+      if (statusFd >= 0) close(statusFd);
+      continue;
+    }
+    batteries[batteryCount++] = (Battery){capacityFd, statusFd};
+  }
+  closedir(dir);
+}
+static void setModuleText(Module *m, const char *fmt, ...) {
+  char text[MODULE_TEXT_SIZE];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(text, sizeof(text), fmt, ap);
+  va_end(ap);
+  if (strcmp(text, m->text) == 0) return;
+  memcpy(m->text, text, sizeof(text));
+  barDirty = 1;
+}
+static void updateClock(Module *m) {
+  char text[9] = "";
+  time_t t     = time(NULL);
   struct tm tm_info;
-  if (localtime_r(&t, &tm_info) == NULL) {
-    timeStr[0] = '\0';
-    return timeStr;
-  }
-  strftime(timeStr, sizeof(timeStr), "%H:%M:%S", &tm_info);
-  return timeStr;
-}
-static char *getBatteryStatus() {
-  static char batteryStatus[64];
-  FILE *capacityFile = fopen("/sys/class/power_supply/BAT0/capacity", "r");
-  FILE *statusFile   = fopen("/sys/class/power_supply/BAT0/status", "r");
-  if (!capacityFile || !statusFile) {
-    snprintf(batteryStatus, sizeof(batteryStatus), "b: Unknown");
-    if (capacityFile) fclose(capacityFile);
-    if (statusFile) fclose(statusFile);
-    return batteryStatus;
-  }
-  int capacity;
-  char status[16];
-  if (fscanf(capacityFile, "%d", &capacity) != 1) {
-    capacity = -1;
-  }
-  if (fscanf(statusFile, "%15s", status) != 1) {
-    status[0] = '\0';
-  }
-  fclose(capacityFile);
-  fclose(statusFile);
-  snprintf(batteryStatus, sizeof(batteryStatus), "b: %d%%%s", capacity,
-           strcmp(status, "Charging") == 0      ? " (char)"
-           : strcmp(status, "Discharging") == 0 ? " (dis)"
-                                                : "");
-  return batteryStatus;
+  if (localtime_r(&t, &tm_info)) strftime(text, sizeof(text), "%H:%M:%S", &tm_info);
+  setModuleText(m, "%s", text);
+}
+static void updateBattery(Module *m) {
+  char text[MODULE_TEXT_SIZE] = "b: Unknown";
+  size_t len                  = 0;
+  for (unsigned char i = 0; i < batteryCount && len < sizeof(text); i++) {
+    char capacity[8], status[16];
+    readSysfs(batteries[i].capacityFd, capacity, sizeof(capacity));
+    readSysfs(batteries[i].statusFd, status, sizeof(status));
+    len += snprintf(text + len, sizeof(text) - len, "%sb: %s%%%s", i ? " " : "",
+                    capacity[0] ? capacity : "-1",
+                    strcmp(status, "Charging") == 0      ? " (char)"
+                    : strcmp(status, "Discharging") == 0 ? " (dis)"
+                                                         : "");
+  }
+  setModuleText(m, "%s", text);
+}
+static void updateCpu(Module *m) {
+  char buf[256];
+  unsigned long long v[8] = {0};
+  if (!readSysfs(m->fd, buf, sizeof(buf)) ||
+      sscanf(buf, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &v[0], &v[1], &v[2], &v[3],
+             &v[4], &v[5], &v[6], &v[7]) < 4) {
+    return;
+  }
+  unsigned long long total = 0, idle = v[3] + v[4];
+  for (int i = 0; i < 8; i++) total += v[i];
+  unsigned long long elapsed = total - m->prev[0], idled = idle - m->prev[1];
+  m->prev[0]                 = total;
+  m->prev[1]                 = idle;
+  setModuleText(m, "c: %llu%%", elapsed ? 100 * (elapsed - idled) / elapsed : 0);
+}
+static void updateMemory(Module *m) {
+  char buf[256];
+  unsigned long total = 0, available = 0;
+  if (!readSysfs(m->fd, buf, sizeof(buf))) return;
+  char *line = strstr(buf, "MemTotal:");
+  if (line) sscanf(line, "MemTotal: %lu", &total);
+  line = strstr(buf, "MemAvailable:");
+  if (line) sscanf(line, "MemAvailable: %lu", &available);
+  if (total) setModuleText(m, "m: %lu%%", 100 - available * 100 / total);
+}
+static void updateDisk(Module *m) {
+  struct statvfs st;
+  if (fstatvfs(m->fd, &st) < 0 || st.f_blocks == 0) return;
+  setModuleText(m, "d: %lu%%", 100 - st.f_bavail * 100 / st.f_blocks);
+}
+static void updateLoad(Module *m) {
+  char buf[64], load[8];
+  if (readSysfs(m->fd, buf, sizeof(buf)) && sscanf(buf, "%7s", load) == 1) {
+    setModuleText(m, "l: %s", load);
+  }
+}
+static void updateDesktop(Module *m) {
+  /* one entry per monitor, the focused one starred when there are several */
+  char text[MODULE_TEXT_SIZE];
+  int len = 0;
+  for (unsigned char i = 0; i < monitorCount && len < (int)sizeof(text); i++) {
+    unsigned char d = monitors[i].desktop;
+    len += snprintf(text + len, sizeof(text) - len, " %s%u (%u)",
+                    monitorCount > 1 && i == currentMonitor ? "*" : "", d + 1,
+                    desktops[d].windowCount);
+  }
+  setModuleText(m, "ws:%s", text);
+}
+static void scheduleModule(Module *m, time_t now) {
+  if (!m->interval) return;
+  Module **slot = &wheel[(now + m->interval) % WHEEL_SLOTS];
+  m->rounds     = (m->interval - 1) / WHEEL_SLOTS;
+  m->nextDue    = *slot;
+  *slot         = m;
+}
+static void setupModules(void) {
+  memset(wheel, 0, sizeof(wheel));
+  wheelTime = time(NULL);
+  for (size_t i = 0; i < MODULE_COUNT; i++) {
+    Module *m = &modules[i];
+    if (m->source && m->fd < 0) m->fd = open(m->source, O_RDONLY | O_CLOEXEC);
+    m->update(m);
+    scheduleModule(m, wheelTime);
+  }
+  armModuleTimer();
+}
+/*
+ * Called when the timer fires. Only the modules in the slots for the seconds that passed are
+ * looked at; a module further than one turn away just counts down its rounds. After a clock
+ * jump or a long stall every module is refreshed and scheduled again.
+ */
+static void advanceModules(void) {
+  time_t now = time(NULL);
+  if (now < wheelTime || now - wheelTime >= WHEEL_SLOTS) {
+    setupModules();
+    return;
+  }
+  while (wheelTime < now) {
+    wheelTime++;
+    Module **slot = &wheel[wheelTime % WHEEL_SLOTS];
+    Module *due   = *slot;
+    *slot         = NULL;
+    while (due) {
+      Module *m = due;
+      due       = m->nextDue;
+      if (m->rounds) {
+        m->rounds--;
+        m->nextDue = *slot;
+        *slot      = m;
+      } else {
+        m->update(m);
+        scheduleModule(m, wheelTime);
+      }
+    }
+  }
+  armModuleTimer();
+}
+static void refreshModules(void (*update)(Module *m)) {
+  for (size_t i = 0; i < MODULE_COUNT; i++) {
+    if (modules[i].update == update) update(&modules[i]);
+  }
+}
+static void closeModules(void) {
+  for (size_t i = 0; i < MODULE_COUNT; i++) {
+    if (modules[i].fd >= 0) close(modules[i].fd);
+    modules[i].fd = -1;
+  }
+}
+/* drains the uevent socket; true if a power supply changed, rescan is set if one came or went */
+static _Bool readUevents(int fd, _Bool *rescan) {
+  /* each datagram is "action@devpath\0KEY=VALUE\0..."; only power_supply ones matter */
+  char buf[4096];
+  _Bool changed = 0;
+  ssize_t n;
+  while ((n = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+    buf[n]            = '\0';
+    _Bool powerSupply = 0;
+    for (char *field = buf; field < buf + n; field += strlen(field) + 1) {
+      if (strcmp(field, "SUBSYSTEM=power_supply") == 0) powerSupply = 1;
+    }
+    if (!powerSupply) continue;
+    changed = 1;
+    if (strncmp(buf, "add@", 4) == 0 || strncmp(buf, "remove@", 7) == 0) *rescan = 1;
+  }
+  return changed;
+}
+static void handleUevent(void) {
+  _Bool rescan = 0;
+  if (!readUevents(pollfds[POLL_UEVENT].fd, &rescan)) return;
+  if (rescan) scanBatteries();
+  refreshModules(updateBattery);
+  drawStatusBar();
+}
+static int barTextWidth(const char *text, int len) {
+  return barFont ? XTextWidth(barFont, text, len) : len * 6;
+}
+static void setupStatusBar(void) {
+  barGC   = XCreateGC(dpy, root, 0, NULL);
+  barFont = XQueryFont(dpy, XGContextFromGC(barGC));
+  resizeStatusBar();
+}
+/* one bar along the bottom of each monitor, all copied from the same buffer */
+static void resizeStatusBar(void) {
+  XSetWindowAttributes wa = {.background_pixmap = None,
+                             .override_redirect = True,
+                             .event_mask        = ExposureMask};
+  unsigned short width    = 0;
+  while (barCount > monitorCount) XDestroyWindow(dpy, bars[--barCount]);
+  while (barCount < monitorCount) {
+    bars[barCount] = XCreateWindow(dpy, root, 0, 0, 1, STATUS_BAR_HEIGHT, 0, CopyFromParent,
+                                   InputOutput, CopyFromParent,
+                                   CWBackPixmap | CWOverrideRedirect | CWEventMask, &wa);
+    XMapRaised(dpy, bars[barCount++]);
+  }
+  for (unsigned char i = 0; i < barCount; i++) {
+    XRectangle *a = &monitors[i].area;
+    XMoveResizeWindow(dpy, bars[i], a->x, a->y + a->height - STATUS_BAR_HEIGHT, a->width,
+                      STATUS_BAR_HEIGHT);
+    if (a->width > width) width = a->width;
+  }
+  if (barBuf) XFreePixmap(dpy, barBuf);
+  barBuf =
+      XCreatePixmap(dpy, root, width, STATUS_BAR_HEIGHT, DefaultDepth(dpy, DefaultScreen(dpy)));
+  XSetForeground(dpy, barGC, COLOR_B);
+  XFillRectangle(dpy, barBuf, barGC, 0, 0, width, STATUS_BAR_HEIGHT);
+  previousStatus[0] = '\0';
+  barDirty          = 1;
+  drawStatusBar();
 }
 static void drawStatusBar() {
-  char status[256];
-  snprintf(status, sizeof(status), "%s | %s ", getCurrentTime(), getBatteryStatus());
-  if (strcmp(status, previousStatus) != 0) {
-    unsigned long backgroundColor = COLOR_B;
-    unsigned long textColor       = COLOR_A;
-    XSetForeground(dpy, DefaultGC(dpy, 0), backgroundColor);
-    XFillRectangle(dpy, root, DefaultGC(dpy, 0), 0, screen_height - STATUS_BAR_HEIGHT, screen_width,
-                   STATUS_BAR_HEIGHT);
-    XSetForeground(dpy, DefaultGC(dpy, 0), textColor);
-    XDrawString(dpy, root, DefaultGC(dpy, 0), 10, screen_height - STATUS_BAR_HEIGHT + 15, status,
-                strlen(status));
-    strncpy(previousStatus, status, sizeof(previousStatus) - 1);
+  if (!barDirty) return;
+  barDirty = 0;
+  char status[sizeof(previousStatus)];
+  int len = 0;
+  for (size_t i = 0; i < MODULE_COUNT && len < (int)sizeof(status); i++) {
+    if (!modules[i].text[0]) continue;
+    len += snprintf(status + len, sizeof(status) - len, "%s%s ", len ? "| " : "", modules[i].text);
+  }
+  if (len >= (int)sizeof(status)) len = sizeof(status) - 1;
+  int prevLen = strlen(previousStatus);
+  int first = 0;
+  while (first < len && status[first] == previousStatus[first]) first++;
+  if (first == len && len == prevLen) return;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  /* damage runs from the first changed glyph to whichever text reaches further right,
+     unless both strings keep the same length and the tail after the last change lines up */
+  int last = len, prevLast = prevLen;
+  while (last > first && prevLast > first && status[last - 1] == previousStatus[prevLast - 1]) {
+    last--;
+    prevLast--;
+  }
+  int x0 = 10 + barTextWidth(status, first);
+  int x1 = 10 + barTextWidth(status, last);
+  if (prevLen == 0 || x1 != 10 + barTextWidth(previousStatus, prevLast)) {
+    last   = len;
+    x1     = 10 + barTextWidth(status, len);
+    int x2 = 10 + barTextWidth(previousStatus, prevLen);
+    if (x2 > x1) x1 = x2;
+  }
+  XSetForeground(dpy, barGC, COLOR_B);
+  XFillRectangle(dpy, barBuf, barGC, x0, 0, x1 - x0, STATUS_BAR_HEIGHT);
+  XSetForeground(dpy, barGC, COLOR_A);
+  XDrawString(dpy, barBuf, barGC, x0, 15, status + first, last - first);
+  for (unsigned char i = 0; i < barCount; i++) {
+    XCopyArea(dpy, barBuf, bars[i], barGC, x0, 0, x1 - x0, STATUS_BAR_HEIGHT, x0, 0);
+  }
+  memcpy(previousStatus, status, len + 1);
+  metrics.barRedraws++;
+  recordTime(metrics.barTimes, elapsedNs(&start));
+}
+static void handleExpose(XEvent *e) {
+  XExposeEvent *ev = &e->xexpose;
+  if (ev->window == osdWin && ev->count == 0) drawOsd();
+  for (unsigned char i = 0; i < barCount; i++) {
+    if (ev->window != bars[i]) continue;
+    XCopyArea(dpy, barBuf, bars[i], barGC, ev->x, ev->y, ev->width, ev->height, ev->x, ev->y);
   }
 }
+static void setupOsd(void) {
+  XSetWindowAttributes wa = {.background_pixel  = COLOR_B,
+                             .border_pixel      = COLOR_A,
+                             .override_redirect = True,
+                             .event_mask        = ExposureMask};
+  osdWin = XCreateWindow(dpy, root, 0, 0, OSD_WIDTH, STATUS_BAR_HEIGHT, BORDER_WIDTH,
+                         CopyFromParent, InputOutput, CopyFromParent,
+                         CWBackPixel | CWBorderPixel | CWOverrideRedirect | CWEventMask, &wa);
+  int sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sock >= 0 && socketAddress(&osdAddr, OSD_SOCKET_NAME)) {
+    unlink(osdAddr.sun_path);
+    if (bind(sock, (struct sockaddr *)&osdAddr, sizeof(osdAddr)) < 0) {
+      close(sock);
+      sock = -1;
+    }
+  } else if (sock >= 0) {
+    close(sock);
+    sock = -1;
+  }
+  pollfds[POLL_OSD] = (struct pollfd){.fd = sock, .events = POLLIN};
+  pollfds[POLL_OSD_TIMER] =
+      (struct pollfd){.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC),
+                      .events = POLLIN};
+}
+static void handleOsdMessage(void) {
+  /* datagrams are "<level> <text>", level -1 for text only; only the newest one is shown */
+  char msg[sizeof(osdText) + 8];
+  ssize_t n, last = -1;
+  while ((n = recv(pollfds[POLL_OSD].fd, msg, sizeof(msg) - 1, 0)) >= 0) last = n;
+  if (last < 0) return;
+  msg[last]  = '\0';
+  char *text = strchr(msg, ' ');
+  osdLevel   = atoi(msg);
+  if (osdLevel > 100) osdLevel = 100;
+  snprintf(osdText, sizeof(osdText), "%s", text ? text + 1 : "");
+  int height = osdLevel >= 0 ? 2 * STATUS_BAR_HEIGHT : STATUS_BAR_HEIGHT;
+  int width  = barTextWidth(osdText, strlen(osdText)) + 20;
+  if (width < OSD_WIDTH) width = OSD_WIDTH;
+  XRectangle *a = &monitors[currentMonitor].area;
+  XMoveResizeWindow(dpy, osdWin, a->x + a->width - width - GAP_SIZE - 2 * BORDER_WIDTH,
+                    a->y + GAP_SIZE, width, height);
+  XMapRaised(dpy, osdWin);
+  drawOsd();
+  struct itimerspec its = {.it_value = {OSD_TIMEOUT_MS / 1000, (OSD_TIMEOUT_MS % 1000) * 1000000L}};
+  timerfd_settime(pollfds[POLL_OSD_TIMER].fd, 0, &its, NULL);
+}
+static void setupControl(void) {
+  int sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sock >= 0 && socketAddress(&ctlAddr, CTL_SOCKET_NAME)) {
+    unlink(ctlAddr.sun_path);
+    if (bind(sock, (struct sockaddr *)&ctlAddr, sizeof(ctlAddr)) < 0) {
+      close(sock);
+      sock = -1;
+    }
+  } else if (sock >= 0) {
+    close(sock);
+    sock = -1;
+  }
+  pollfds[POLL_CTL] = (struct pollfd){.fd = sock, .events = POLLIN};
+}
+static int appendReply(char *reply, int len, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(reply + len, CTL_MESSAGE_SIZE - len, fmt, ap);
+  va_end(ap);
+  return n < 0 || len + n >= CTL_MESSAGE_SIZE ? CTL_MESSAGE_SIZE - 1 : len + n;
+}
+static int queryState(char *reply, int len) {
+  for (unsigned char i = 0; i < monitorCount; i++) {
+    XRectangle *a = &monitors[i].area;
+    len = appendReply(reply, len, "monitor %u %d %d %u %u desktop %u%s\n", i + 1, a->x, a->y,
+                      a->width, a->height, monitors[i].desktop + 1,
+                      i == currentMonitor ? " current" : "");
+  }
+  for (unsigned char i = 0; i < MAX_DESKTOPS; i++) {
+    Desktop *d = &desktops[i];
+    len        = appendReply(reply, len, "desktop %u windows %u%s\n", i + 1, d->windowCount,
+                             i == currentDesktop ? " current" : "");
+    for (Client *c = d->head; c; c = c->next) {
+      len = appendReply(reply, len, "window 0x%lx %d %d %d %d%s\n", c->win, c->have.x, c->have.y,
+                        c->have.w, c->have.h, c == d->focused ? " focused" : "");
+    }
+  }
+  return len;
+}
+static void ctlView(const Arg *arg) { switchDesktop(arg->i - 1); }
+/* "name [arg]" from commands[]; 0 for a blank command, -1 for an invalid one */
+static int parseCommand(const char *cmd, const Command **command, Arg *arg) {
+  char name[16], value[16] = "", extra[2];
+  int fields = sscanf(cmd, "%15s %15s %1s", name, value, extra);
+  if (fields <= 0) return 0;
+  size_t i = 0;
+  while (i < COMMAND_COUNT && strcmp(commands[i].name, name) != 0) i++;
+  if (i == COMMAND_COUNT || fields != 1 + (commands[i].argType != ARG_NONE)) return -1;
+  const Command *c = &commands[i];
+  arg->i           = 0;
+  if (c->argType == ARG_DIRECTION) {
+    if (strcmp(value, "next") == 0) {
+      arg->i = 1;
+    } else if (strcmp(value, "prev") == 0) {
+      arg->i = -1;
+    } else {
+      return -1;
+    }
+  } else if (c->argType == ARG_NUMBER) {
+    char *end;
+    long n = strtol(value, &end, 10);
+    if (end == value || *end || n < c->min || n > c->max) return -1;
+    arg->i = n;
+  }
+  *command = c;
+  return 1;
+}
+static void ctlMove(const Arg *arg) { keyMove(&(Arg){.i = arg->i - 1}); }
+/*
+ * A message is a batch of commands separated by ';' or newlines, e.g. "view 2; focus next".
+ * The batch is parsed completely before anything runs, so a bad command rejects the whole
+ * message, and the layout is flushed once after the last command so the batch costs one tiling
+ * pass.
+ * query needs no round trips and reports the state after the batch.
+ */
+static void handleControlMessage(void) {
+  char msg[CTL_MESSAGE_SIZE], reply[CTL_MESSAGE_SIZE];
+  struct sockaddr_un from;
+  for (;;) {
+    socklen_t fromLen = sizeof(from);
+    ssize_t n         = recvfrom(pollfds[POLL_CTL].fd, msg, sizeof(msg) - 1, 0,
+                                 (struct sockaddr *)&from, &fromLen);
+    if (n < 0) return;
+    msg[n] = '\0';
+    const Command *batch[CTL_MAX_BATCH];
+    Arg args[CTL_MAX_BATCH];
+    int count = 0, len = 0;
+    _Bool query = 0;
+    char *save, *cmd;
+    for (cmd = strtok_r(msg, ";\n", &save); cmd; cmd = strtok_r(NULL, ";\n", &save)) {
+      const Command *command;
+      Arg arg;
+      int parsed = parseCommand(cmd, &command, &arg);
+      if (parsed == 0) continue;
+      if (parsed < 0 || count == CTL_MAX_BATCH) {
+        len = appendReply(reply, 0, "error: %s\n", cmd);
+        break;
+      }
+      query |= !command->func;
+      args[count]    = arg;
+      batch[count++] = command;
+    }
+    if (!cmd) {
+      for (int i = 0; i < count; i++) {
+        if (batch[i]->func) batch[i]->func(&args[i]);
+      }
+      recordFlush();
+      len = appendReply(reply, 0, "ok\n");
+      if (query) len = queryState(reply, len);
+    }
+    if (fromLen > sizeof(sa_family_t)) {
+      sendto(pollfds[POLL_CTL].fd, reply, len, MSG_DONTWAIT, (struct sockaddr *)&from, fromLen);
+    }
+  }
+}
+static void drawOsd(void) {
+  XClearWindow(dpy, osdWin);
+  XSetForeground(dpy, barGC, COLOR_A);
+  XDrawString(dpy, osdWin, barGC, 10, 15, osdText, strlen(osdText));
+  if (osdLevel < 0) return;
+  XDrawRectangle(dpy, osdWin, barGC, 10, STATUS_BAR_HEIGHT + 4, OSD_WIDTH - 21,
+                 STATUS_BAR_HEIGHT - 9);
+  XFillRectangle(dpy, osdWin, barGC, 10, STATUS_BAR_HEIGHT + 4, (OSD_WIDTH - 20) * osdLevel / 100,
+                 STATUS_BAR_HEIGHT - 8);
+}
+/* a window event or a control command per line, as written by mwmp -g */
+static int parseReplayEvent(const char *line, ReplayEvent *ev) {
+  static const int argCounts[] = {0, 1, 1, 1, 2, 1, 0, 1, 0, 0};
+  char name[16];
+  int n = 0;
+  *ev = (ReplayEvent){0};
+  if (sscanf(line, "%15s%n", name, &n) != 1 || name[0] == '#') return 0;
+  for (size_t i = REPLAY_MAP; i < sizeof(replayNames) / sizeof(replayNames[0]); i++) {
+    if (strcmp(name, replayNames[i]) != 0) continue;
+    long a = 0, b = 0;
+    int fields = sscanf(line + n, "%li %li", &a, &b);
+    if ((fields < 0 ? 0 : fields) != argCounts[i] || a < 0 || b < 0) return -1;
+    if (i == REPLAY_SPLIT && (a < 1 || a > MAX_MONITORS)) return -1;
+    if (i == REPLAY_SCREEN && (a < MAX_MONITORS * MIN_MONITOR_SIZE || a > USHRT_MAX ||
+                               b < MIN_MONITOR_SIZE || b > USHRT_MAX)) {
+      return -1;
+    }
+    *ev = (ReplayEvent){.type = i, .a = a, .b = b};
+    return 1;
+  }
+  ev->type = REPLAY_COMMAND;
+  return parseCommand(line, &ev->command, &ev->arg);
+}
+static void splitScreen(int count) {
+  XRectangle areas[MAX_MONITORS];
+  for (int i = 0; i < count; i++) {
+    areas[i] = (XRectangle){screen_width * i / count, 0, screen_width / count, screen_height};
+  }
+  setMonitors(areas, count);
+}
+/* the state a restart saves, restored into a fresh core with the same monitors */
+static void replayRestart(void) {
+  XRectangle areas[MAX_MONITORS];
+  int count = monitorCount;
+  size_t n;
+  applyOps();
+  for (int i = 0; i < count; i++) areas[i] = monitors[i].area;
+  long *data     = stateData(&n);
+  Window *exists = malloc((clientIndexUsed + 1) * sizeof(*exists));
+  if (!data || !exists) die("out of memory");
+  unsigned int windows = 0;
+  for (size_t i = 3; i + SAVED_FIELDS <= n; i += SAVED_FIELDS) exists[windows++] = data[i];
+  qsort(exists, windows, sizeof(*exists), compareWindows);
+  cleanupCore();
+  setupCore();
+  setMonitors(areas, count);
+  restoreState((const unsigned long *)data, n, exists, windows, NULL);
+  markLayoutDirty();
+  free(exists);
+  free(data);
+}
+static void replayEvent(const ReplayEvent *ev) {
+  Client *c;
+  switch (ev->type) {
+    case REPLAY_COMMAND:
+      if (ev->command->func) ev->command->func(&ev->arg);
+      break;
+    case REPLAY_MAP:
+      if ((c = manageClient(ev->a, currentDesktop))) showNewClient(c);
+      break;
+    case REPLAY_UNMAP:
+      withdrawClient(ev->a);
+      break;
+    case REPLAY_DESTROY:
+      if ((c = findClient(ev->a))) unmanageClient(c);
+      break;
+    case REPLAY_SCREEN:
+      screen_width  = ev->a;
+      screen_height = ev->b;
+      splitScreen(monitorCount);
+      break;
+    case REPLAY_SPLIT:
+      splitScreen(ev->a);
+      break;
+    case REPLAY_FLUSH:
+      flushLayout();
+      break;
+    case REPLAY_FLOAT:
+      if ((c = manageClient(ev->a, currentDesktop))) {
+        setFloating(c, 0, 0, screen_width / 4, screen_height / 4);
+        showNewClient(c);
+      }
+      break;
+    case REPLAY_RESTART:
+      replayRestart();
+      break;
+    case REPLAY_QUIT:
+      releaseClients();
+      break;
+  }
+}
+/* holds between any two events; after a flush, the windows must also be where they belong */
+static const char *checkInvariants(_Bool flushed) {
+  size_t total = 0;
+  for (unsigned char i = 0; i < MAX_DESKTOPS; i++) {
+    Desktop *d         = &desktops[i];
+    unsigned int count = 0;
+    _Bool hasFocused   = 0;
+    int shown          = monitorOf(i);
+    XRectangle *area   = &monitors[shown >= 0 ? shown : 0].area;
+    for (Client *c = d->head; c; c = c->next) {
+      if ((c->prev ? c->prev->next : d->head) != c || (!c->next && d->tail != c)) {
+        return "broken desktop list";
+      }
+      if (c->desktop != i) return "client on the wrong desktop";
+      if (findClient(c->win) != c) return "client missing from the index";
+      hasFocused |= c == d->focused;
+      count++;
+      if (!flushed) continue;
+      if (shown >= 0 && (!c->have.mapped || c->have.wmState != NormalState)) {
+        return "window on a shown desktop not shown";
+      }
+      if (shown >= 0 && (c->have.w < 1 || c->have.h < 1)) return "window without a size";
+      if (shown >= 0 && c->floatGeometry.width && !c->raised) {
+        return "floating window below the tiles";
+      }
+      if (shown >= 0 && !c->floatGeometry.width &&
+          (c->have.x < area->x || c->have.y < area->y ||
+           c->have.x + c->have.w + 2 * BORDER_WIDTH > area->x + area->width ||
+           c->have.y + c->have.h + 2 * BORDER_WIDTH > area->y + area->height)) {
+        return "window outside its monitor";
+      }
+      if (shown < 0 && (c->have.wmState != IconicState || (c->have.mapped && c->have.x >= 0))) {
+        return "window from a hidden desktop left on screen";
+      }
+    }
+    if (count != d->windowCount) return "wrong window count";
+    if (count ? !hasFocused : d->focused != NULL) return "focus outside its desktop";
+    total += count;
+  }
+  if (total != clientIndexUsed) return "stale windows in the index";
+  /* with the count above, this leaves exactly the listed clients in the index, each findable */
+  size_t used = 0;
+  for (size_t i = 0; i < clientIndexSize; i++) {
+    if (!clientIndex[i]) continue;
+    used++;
+    size_t mask = clientIndexSize - 1;
+    for (size_t j = clientHash(clientIndex[i]->win, clientIndexSize); j != i; j = (j + 1) & mask) {
+      if (!clientIndex[j]) return "index entry cut off from its home bucket";
+    }
+  }
+  if (used != clientIndexUsed) return "index entries not counted";
+  for (unsigned char i = 0; i < monitorCount; i++) {
+    if (monitorOf(monitors[i].desktop) != i) return "desktop shown on two monitors";
+  }
+  if (currentMonitor >= monitorCount || currentDesktop != monitors[currentMonitor].desktop) {
+    return "current desktop not on the current monitor";
+  }
+  Client *focused = desktops[currentDesktop].focused;
+  if (flushed && inputFocus != (focused ? focused->win : root)) {
+    return "input focus not on the focused window";
+  }
+  return NULL;
+}
+/* a fresh window model on the replay screen, with ops counted instead of sent */
+static void startReplay(void) {
+  replaying     = 1;
+  screen_width  = REPLAY_WIDTH;
+  screen_height = REPLAY_HEIGHT;
+  metrics       = (Metrics){0};
+  memset(opTotals, 0, sizeof(opTotals));
+  setupCore();
+}
+/*
+ * After a quit, nothing is left mapped, nor parked where the next window manager would map it.
+ * A window never sized here has w 0 and was never parked either.
+ */
+static const char *checkReleased(void) {
+  for (unsigned char i = 0; i < MAX_DESKTOPS; i++) {
+    for (Client *c = desktops[i].head; c; c = c->next) {
+      if (c->have.mapped) return "window left mapped on quit";
+      if (c->have.x == INT_MIN ||
+          (c->have.w > 0 && c->have.x + c->have.w + 2 * c->have.borderWidth <= 0)) {
+        return "window left off-screen on quit";
+      }
+    }
+  }
+  return NULL;
+}
+/* what must hold after ev was replayed, NULL if it does */
+static const char *checkEvent(const ReplayEvent *ev) {
+  return ev->type == REPLAY_QUIT ? checkReleased() : checkInvariants(ev->type == REPLAY_FLUSH);
+}
+/*
+ * mwmp -r trace runs a recorded or generated trace through the window model without an X server.
+ * The first pass is timed, the second checks the invariants after every event.
+ */
+static int replayTrace(const char *path) {
+  FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  if (!f) {
+    perror(path);
+    return EXIT_FAILURE;
+  }
+  ReplayEvent *events = NULL;
+  size_t count = 0, size = 0;
+  unsigned long line = 0;
+  char buf[256];
+  while (fgets(buf, sizeof(buf), f)) {
+    line++;
+    if (count == size) {
+      size = size ? size * 2 : 4096;
+      if (!(events = realloc(events, size * sizeof(*events)))) die("out of memory");
+    }
+    int parsed = parseReplayEvent(buf, &events[count]);
+    if (parsed < 0) {
+      fprintf(stderr, "mwm: %s:%lu: bad event: %s", path, line, buf);
+      free(events);
+      if (f != stdin) fclose(f);
+      return EXIT_FAILURE;
+    }
+    if (parsed) events[count++].line = line;
+  }
+  if (f != stdin) fclose(f);
+  int status = EXIT_SUCCESS;
+  /* flushes that retile, timed on the first pass: with deep stacks this is the relayout cost */
+  long *relayoutTimes = malloc((count + 1) * sizeof(*relayoutTimes));
+  size_t relayouts    = 0;
+  if (!relayoutTimes) die("out of memory");
+  _Bool quit = 0;
+  for (int pass = 0; pass < 2 && status == EXIT_SUCCESS; pass++) {
+    startReplay();
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < count; i++) {
+      if (!pass && events[i].type == REPLAY_FLUSH && layoutDirty) {
+        struct timespec flushStart;
+        clock_gettime(CLOCK_MONOTONIC, &flushStart);
+        replayEvent(&events[i]);
+        relayoutTimes[relayouts++] = elapsedNs(&flushStart);
+        continue;
+      }
+      replayEvent(&events[i]);
+      quit              = events[i].type == REPLAY_QUIT;
+      const char *error = pass ? checkEvent(&events[i]) : NULL;
+      if (error) {
+        fprintf(stderr, "mwm: %s:%lu: %s\n", path, events[i].line, error);
+        status = EXIT_FAILURE;
+      }
+      if (error || quit) break;
+    }
+    if (!quit) flushLayout();
+    long ns = elapsedNs(&start);
+    if (!pass) {
+      printf("%zu events in %.3f s, %.0f events/s\n", count, ns / 1e9, ns ? count * 1e9 / ns : 0);
+      printf("relayouts %lu of %lu requested, configures %lu\nops", metrics.relayouts,
+             metrics.layoutRequests, metrics.configures);
+      for (int i = 0; i < OP_COUNT; i++) printf(" %s %lu", opNames[i], opTotals[i]);
+      printf("\n");
+      if (relayouts) {
+        qsort(relayoutTimes, relayouts, sizeof(*relayoutTimes), compareLong);
+        printf("relayout p50 %.1f us p99 %.1f us over %zu flushes\n",
+               relayoutTimes[(relayouts - 1) / 2] / 1e3,
+               relayoutTimes[(relayouts - 1) * 99 / 100] / 1e3, relayouts);
+      }
+    }
+    cleanupCore();
+  }
+  if (status == EXIT_SUCCESS) printf("invariants held after every event\n");
+  free(relayoutTimes);
+  free(events);
+  return status;
+}
+/* mwmp -g count [seed] prints a random trace for mwmp -r */
+static int generateTrace(unsigned long count, unsigned int seed) {
+  Window live[4096]; /* thousands, so the index grows and shifts entries back on every removal */
+  unsigned int liveCount = 0;
+  Window next            = 0x400001;
+  srand(seed);
+  for (unsigned long i = 0; i < count; i++) {
+    int r = rand() % 100;
+    if (!liveCount || (r < 20 && liveCount < sizeof(live) / sizeof(live[0]))) {
+      printf("%s 0x%lx\n", r < 2 ? "float" : "map", next);
+      live[liveCount++] = next++;
+    } else if (r < 33) {
+      unsigned int j = rand() % liveCount;
+      printf("%s 0x%lx\n", r < 30 ? "destroy" : "unmap", live[j]);
+      live[j] = live[--liveCount];
+    } else if (r < 48) {
+      printf("view %d\n", rand() % MAX_DESKTOPS + 1);
+    } else if (r < 58) {
+      printf("move %d\n", rand() % MAX_DESKTOPS + 1);
+    } else if (r < 75) {
+      printf("focus %s\n", rand() % 2 ? "next" : "prev");
+    } else if (r < 78) {
+      printf("monitor %s\n", rand() % 2 ? "next" : "prev");
+    } else if (r < 88) {
+      printf("resize %d\n", rand() % 2 ? RESIZE_STEP : -RESIZE_STEP);
+    } else if (r < 89 && rand() % 2) {
+      /* split 4 of the narrowest screens leaves monitors too narrow for the usual margins */
+      printf("screen %d %d\n", MAX_MONITORS * MIN_MONITOR_SIZE + rand() % 4001,
+             MIN_MONITOR_SIZE + rand() % 2121);
+    } else if (r < 89) {
+      printf("split %d\n", rand() % MAX_MONITORS + 1);
+    } else if (r < 90) {
+      printf("kill\n");
+    } else if (r < 91 && rand() % 4 == 0) {
+      printf("restart\n");
+    } else {
+      printf("flush\n");
+    }
+  }
+  printf("flush\n");
+  return EXIT_SUCCESS;
+}
 inline static void die(const char *msg) {
   fprintf(stderr, "mwm: %s\n", msg);
   exit(EXIT_FAILURE);
 }
-static void sigHandler(int sig) {
-  (void)sig;
-  running = 0;
-}
 static int xerrorstart(Display *dpy __attribute__((unused)),
                        XErrorEvent *ee __attribute__((unused))) {
   die("another window manager is already running");
@@ -144,71 +1403,377 @@ static int xerrorstart(Display *dpy __attribute__((unused)),
 }
 static int xerror(Display *dpy, XErrorEvent *ee) {
   (void)dpy;
-  (void)ee;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  metrics.errors[ee->error_code]++;
+  TraceEntry *t = &trace[traceCount++ % TRACE_SIZE];
+  *t = (TraceEntry){.startNs       = now.tv_sec * 1000000000L + now.tv_nsec,
+                    .detail        = ee->error_code,
+                    .request       = ee->request_code,
+                    .desktopBefore = currentDesktop,
+                    .desktopAfter  = currentDesktop,
+                    .windowCount   = desktops[currentDesktop].windowCount,
+                    .window        = ee->resourceid,
+                    .focusBefore   = modelFocus(),
+                    .focusAfter    = modelFocus()};
   return 0;
 }
+/* the trace records the model's focus, inputFocus only catches up when a flush sends it */
+static inline Window modelFocus(void) {
+  Client *focused = desktops[currentDesktop].focused;
+  return focused ? focused->win : None;
+}
+static inline long elapsedNs(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000000L + (now.tv_nsec - start->tv_nsec);
+}
+static inline void recordTime(unsigned long *hist, long ns) {
+  unsigned long us = ns / 1000;
+  int bucket       = us ? 64 - __builtin_clzl(us) : 0;
+  hist[bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1]++;
+}
+static void writeHistogram(FILE *f, const unsigned long *hist) {
+  fputc('[', f);
+  for (int i = 0; i < HIST_BUCKETS; i++) fprintf(f, "%s%lu", i ? "," : "", hist[i]);
+  fputc(']', f);
+}
+/*
+ * snapshots are written next to a temporary name and renamed so readers never see a partial file.
+ * Without XDG_RUNTIME_DIR that name is predictable in /tmp, so it is created exclusively, never
+ * through a symlink, and only readable by us; a stale one from a crash is unlinked first.
+ */
+static FILE *openSnapshot(const char *name, char *path, size_t size) {
+  char tmp[PATH_MAX];
+  if (!runtimePath(path, size, name)) return NULL;
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  unlink(tmp);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd < 0) return NULL;
+  FILE *f = fdopen(fd, "w");
+  if (!f) {
+    close(fd);
+    unlink(tmp);
+  }
+  return f;
+}
+static void closeSnapshot(FILE *f, const char *path) {
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if (fclose(f) == 0) rename(tmp, path);
+}
+static void dumpMetrics(void) {
+  char path[PATH_MAX - 8];
+  FILE *f = openSnapshot(METRICS_FILE_NAME, path, sizeof(path));
+  if (!f) return;
+  fprintf(f, "{\"events\":{");
+  const char *sep = "";
+  for (int i = 0; i < LASTEvent; i++) {
+    if (!metrics.events[i]) continue;
+    if (eventNames[i]) {
+      fprintf(f, "%s\"%s\":", sep, eventNames[i]);
+    } else {
+      fprintf(f, "%s\"%d\":", sep, i);
+    }
+    fprintf(f, "{\"count\":%lu,\"requests\":%lu,\"us_log2\":", metrics.events[i],
+            metrics.eventRequests[i]);
+    writeHistogram(f, metrics.eventTimes[i]);
+    fputc('}', f);
+    sep = ",";
+  }
+  fprintf(f,
+          "},\"bursts\":%lu,\"layout_requests\":%lu,\"relayouts\":%lu,\"requests\":%lu,"
+          "\"configures\":%lu,\"motions_dropped\":%lu,\"errors\":{",
+          metrics.bursts, metrics.layoutRequests, metrics.relayouts, NextRequest(dpy) - 1,
+          metrics.configures, metrics.motionsDropped);
+  sep = "";
+  for (int i = 0; i < 256; i++) {
+    if (!metrics.errors[i]) continue;
+    fprintf(f, "%s\"%d\":%lu", sep, i, metrics.errors[i]);
+    sep = ",";
+  }
+  fprintf(f, "},\"bar\":{\"redraws\":%lu,\"us_log2\":", metrics.barRedraws);
+  writeHistogram(f, metrics.barTimes);
+  fprintf(f, "}}\n");
+  closeSnapshot(f, path);
+}
+/* Chrome trace_event format, loadable in Perfetto or chrome://tracing */
+static void dumpTrace(void) {
+  char path[PATH_MAX - 8];
+  FILE *f = openSnapshot(TRACE_FILE_NAME, path, sizeof(path));
+  if (!f) return;
+  unsigned long first = traceCount > TRACE_SIZE ? traceCount - TRACE_SIZE : 0;
+  fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  for (unsigned long i = first; i < traceCount; i++) {
+    const TraceEntry *t = &trace[i % TRACE_SIZE];
+    fprintf(f, "%s\n{\"pid\":1,\"tid\":1,\"ts\":%ld.%03ld,", i > first ? "," : "",
+            t->startNs / 1000, t->startNs % 1000);
+    if (t->type) {
+      fprintf(f, "\"ph\":\"X\",\"dur\":%u.%03u,\"name\":\"%s\",", t->durationNs / 1000,
+              t->durationNs % 1000, eventNames[t->type] ? eventNames[t->type] : "other");
+    } else {
+      fprintf(f, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"XError\",");
+    }
+    fprintf(f,
+            "\"args\":{\"type\":%u,\"window\":%lu,\"requests\":%u,\"error\":%u,"
+            "\"request\":%u,\"desktop\":[%u,%u],\"focus\":[%lu,%lu],\"windows\":%u}}",
+            t->type, t->window, t->requests, t->detail, t->request, t->desktopBefore,
+            t->desktopAfter, t->focusBefore, t->focusAfter, t->windowCount);
+  }
+  fprintf(f, "\n]}\n");
+  closeSnapshot(f, path);
+}
+static void recordEvent(int type, Window win, const struct timespec *start,
+                        unsigned long firstRequest, unsigned char desktopBefore,
+                        Window focusBefore) {
+  long ns                = elapsedNs(start);
+  unsigned long requests = NextRequest(dpy) - firstRequest;
+  metrics.events[type]++;
+  metrics.eventRequests[type] += requests;
+  recordTime(metrics.eventTimes[type], ns);
+  TraceEntry *t = &trace[traceCount++ % TRACE_SIZE];
+  *t = (TraceEntry){.startNs       = start->tv_sec * 1000000000L + start->tv_nsec,
+                    .durationNs    = ns,
+                    .requests      = requests,
+                    .type          = type,
+                    .desktopBefore = desktopBefore,
+                    .desktopAfter  = currentDesktop,
+                    .windowCount   = desktops[currentDesktop].windowCount,
+                    .window        = win,
+                    .focusBefore   = focusBefore,
+                    .focusAfter    = modelFocus()};
+#ifdef DEBUG_REQUESTS
+  fprintf(stderr, "{\"event\":\"%s\",\"window\":%lu,\"requests\":%lu,\"ns\":%ld}\n",
+          eventNames[type] ? eventNames[type] : "other", win, requests, ns);
+#endif
+}
+/* flushLayout with its requests accounted like an event, skipped when it had nothing to send */
+static void recordFlush(void) {
+  unsigned long firstRequest  = NextRequest(dpy);
+  unsigned char desktopBefore = currentDesktop;
+  Window focusBefore          = modelFocus();
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+#ifdef DEBUG_ROUNDTRIPS
+  currentEvent = FlushEvent;
+#endif
+  flushLayout();
+  if (NextRequest(dpy) != firstRequest) {
+    recordEvent(FlushEvent, None, &start, firstRequest, desktopBefore, focusBefore);
+  }
+}
 static void setup(void) {
   if (!getenv("DISPLAY")) die("DISPLAY not set");
   if (!(dpy = XOpenDisplay(NULL))) die("cannot open display");
-  root = DefaultRootWindow(dpy);
-  for (unsigned char i = 0; i < MAX_DESKTOPS; i++) {
-    desktops[i].windowCount = 0;
-    desktops[i].focusedIdx  = 0;
-    for (unsigned char j = 0; j < MAX_WINDOWS_PER_DESKTOP; j++) {
-      desktops[i].windows[j]  = None;
-      desktops[i].isMapped[j] = 0;
-    }
-  }
-  XWindowAttributes attr;
-  XGetWindowAttributes(dpy, root, &attr);
-  screen_width  = attr.width;
-  screen_height = attr.height;
+  root          = DefaultRootWindow(dpy);
+  screen_width  = DisplayWidth(dpy, DefaultScreen(dpy));
+  screen_height = DisplayHeight(dpy, DefaultScreen(dpy));
+  setupCore();
+  ROUNDTRIP(XInternAtoms(dpy, atomNames, AtomCount, False, atoms));
   XSetErrorHandler(xerrorstart);
-  XSelectInput(dpy, root, SubstructureRedirectMask | SubstructureNotifyMask | StructureNotifyMask);
+  XSelectInput(dpy, root,
+               SubstructureRedirectMask | SubstructureNotifyMask | StructureNotifyMask |
+                   FocusChangeMask);
   Cursor cursor = XCreateFontCursor(dpy, 68);
   XDefineCursor(dpy, root, cursor);
-  XSync(dpy, False);
+  ROUNDTRIP(XSync(dpy, False));
   XSetErrorHandler(xerror);
+  setupBindings();
+  setupSpawn();
   grabKeys();
-  XSync(dpy, False);
+  setupMonitors();
+  setupStatusBar();
+  setupOsd();
+  setupControl();
+  setupEwmh();
+  compileRules();
+  adoptWindows();
+  ROUNDTRIP(XSync(dpy, False));
+  setupPollFds();
+  /* only now is SIGCHLD blocked and read from the signalfd, so no pool terminal's exit is lost */
+  refillPool();
 }
-static void grabKeys(void) {
-  const unsigned int modifiers[] = {MOD_KEY, MOD_KEY | ShiftMask};
-  const unsigned char modCount   = sizeof(modifiers) / sizeof(modifiers[0]);
-  KeyCode keycodes[40];
-  int k = 0;
+/* an empty window model on desktop 1, shared by setup() and mwmp -r */
+static void setupCore(void) {
   for (unsigned char i = 0; i < MAX_DESKTOPS; i++) {
-    keycodes[k++] = XKeysymToKeycode(dpy, XK_1 + i);
+    desktops[i] = (Desktop){NULL, NULL, NULL, 0};
+  }
+  monitors[0]     = (Monitor){{0, 0, screen_width, screen_height}, 0};
+  monitorCount    = 1;
+  currentMonitor  = 0;
+  currentDesktop  = 0;
+  resizeDelta     = 0;
+  inputFocus      = None;
+  layoutDirty     = focusDirty = serverGrabbed = 0;
+  clientIndexSize = CLIENT_INDEX_MIN;
+  clientIndexUsed = 0;
+  if (!(clientIndex = calloc(clientIndexSize, sizeof(*clientIndex)))) die("out of memory");
+}
+static void cleanupCore(void) {
+  for (size_t i = 0; i < clientSlabCount; i++) free(clientSlabs[i]);
+  free(clientSlabs);
+  free(clientIndex);
+  clientSlabs     = NULL;
+  clientSlabCount = 0;
+  freeClients     = NULL;
+  clientIndex     = NULL;
+  opCount         = 0;
+}
+static void setupMonitors(void) {
+#ifdef USE_XRANDR
+  int errorBase, major, minor;
+  if (XRRQueryExtension(dpy, &randrEventBase, &errorBase) &&
+      ROUNDTRIP(XRRQueryVersion(dpy, &major, &minor)) && (major > 1 || minor >= 5)) {
+    XRRSelectInput(dpy, root,
+                   RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask | RROutputChangeNotifyMask);
+  } else {
+    randrEventBase = -1;
+  }
+#endif
+  updateMonitors();
+}
+/*
+ * Re-reads the monitors after RandR reported a change, at most once per drained event queue.
+ * The primary output comes first so it starts on desktop 1.
+ */
+static void updateMonitors(void) {
+  XRectangle areas[MAX_MONITORS];
+  int count     = 0;
+  monitorsDirty = 0;
+#ifdef USE_XRANDR
+  int n                = 0;
+  XRRMonitorInfo *info = NULL;
+  if (randrEventBase >= 0) info = ROUNDTRIP(XRRGetMonitors(dpy, root, True, &n));
+  for (int i = 0; i < n && count < MAX_MONITORS; i++) {
+    XRectangle area = {info[i].x, info[i].y, info[i].width, info[i].height};
+    if (info[i].primary && count) {
+      areas[count++] = areas[0];
+      areas[0]       = area;
+    } else {
+      areas[count++] = area;
+    }
   }
-  KeySym specialKeys[] = {XK_q, XK_j, XK_k, XK_h, XK_l};
-  for (size_t i = 0; i < sizeof(specialKeys) / sizeof(specialKeys[0]); i++) {
-    keycodes[k++] = XKeysymToKeycode(dpy, specialKeys[i]);
+  if (info) XRRFreeMonitors(info);
+#endif
+  if (!count) areas[count++] = (XRectangle){0, 0, screen_width, screen_height};
+  setMonitors(areas, count);
+  if (barGC) resizeStatusBar();
+}
+static void setupPollFds(void) {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGCHLD);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGUSR2);
+  sigaddset(&mask, SIGHUP);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) die("cannot block signals");
+  int sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (sfd < 0) die("cannot create signalfd");
+  int tfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (tfd < 0) die("cannot create timerfd");
+  pollfds[POLL_X]      = (struct pollfd){.fd = ConnectionNumber(dpy), .events = POLLIN};
+  pollfds[POLL_TIMER]  = (struct pollfd){.fd = tfd, .events = POLLIN};
+  pollfds[POLL_SIGNAL] = (struct pollfd){.fd = sfd, .events = POLLIN};
+  int ufd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+  struct sockaddr_nl addr = {.nl_family = AF_NETLINK, .nl_groups = 1};
+  if (ufd >= 0 && bind(ufd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(ufd);
+    ufd = -1;
   }
-  for (int i = 0; i < k; i++) {
-    if (keycodes[i] == 0) continue;
-    for (unsigned char j = 0; j < modCount; j++) {
-      XGrabKey(dpy, keycodes[i], modifiers[j], root, True, GrabModeAsync, GrabModeAsync);
+  /* a negative fd is skipped by poll(), so the bar simply stops tracking plug events */
+  pollfds[POLL_UEVENT] = (struct pollfd){.fd = ufd, .events = POLLIN};
+  pollfds[POLL_FRAME] =
+      (struct pollfd){.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC),
+                      .events = POLLIN};
+  scanBatteries();
+  setupModules();
+}
+static void armModuleTimer(void) {
+  /* sleep until the wall-clock second of the next occupied slot; cancelled by clock jumps */
+  struct itimerspec its = {0};
+  for (time_t t = wheelTime + 1; t <= wheelTime + WHEEL_SLOTS; t++) {
+    if (wheel[t % WHEEL_SLOTS]) {
+      its.it_value.tv_sec = t;
+      break;
     }
   }
-  const size_t launcherCount = sizeof(launchers) / sizeof(launchers[0]);
-  for (size_t i = 0; i < launcherCount; i++) {
-    KeyCode code = XKeysymToKeycode(dpy, launchers[i].keysym);
-    if (code != 0) {
-      XGrabKey(dpy, code, MOD_KEY, root, True, GrabModeAsync, GrabModeAsync);
+  timerfd_settime(pollfds[POLL_TIMER].fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL);
+}
+static void setupBindings(void) {
+  for (size_t i = 0; i < KEY_COUNT; i++) bindings[bindingCount++] = keys[i];
+  for (int i = 0; i < MAX_DESKTOPS; i++) {
+    bindings[bindingCount++] = (Key){MOD_KEY, XK_1 + i, keyView, {.i = i}};
+    bindings[bindingCount++] = (Key){MOD_KEY | ShiftMask, XK_1 + i, keyMove, {.i = i}};
+  }
+  for (size_t i = 0; i < LAUNCHER_COUNT; i++) {
+    bindings[bindingCount++] =
+        (Key){MOD_KEY, launchers[i].keysym, keySpawn, {.cmd = launchers[i].command}};
+  }
+}
+static inline unsigned int modIndex(unsigned int state) {
+  return (!!(state & ShiftMask)) | (!!(state & ControlMask) << 1) | (!!(state & Mod1Mask) << 2) |
+         (!!(state & Mod4Mask) << 3);
+}
+static void updateNumlockMask(void) {
+  XModifierKeymap *modmap = XGetModifierMapping(dpy);
+  KeyCode numlock         = XKeysymToKeycode(dpy, XK_Num_Lock);
+  numlockMask             = 0;
+  for (int i = 0; i < 8; i++) {
+    for (int j = 0; j < modmap->max_keypermod; j++) {
+      if (numlock && modmap->modifiermap[i * modmap->max_keypermod + j] == numlock) {
+        numlockMask = 1 << i;
+      }
     }
   }
+  XFreeModifiermap(modmap);
+}
+static void grabKeys(void) {
+  updateNumlockMask();
+  const unsigned int lockVariants[] = {0, LockMask, numlockMask, LockMask | numlockMask};
+  memset(keyTable, 0, sizeof(keyTable));
+  XUngrabKey(dpy, AnyKey, AnyModifier, root);
+  for (unsigned char i = 0; i < bindingCount; i++) {
+    KeyCode code = XKeysymToKeycode(dpy, bindings[i].keysym);
+    if (code == 0) continue;
+    keyTable[code][modIndex(bindings[i].mod)] = i + 1;
+    for (size_t j = 0; j < sizeof(lockVariants) / sizeof(lockVariants[0]); j++) {
+      XGrabKey(dpy, code, bindings[i].mod | lockVariants[j], root, True, GrabModeAsync,
+               GrabModeAsync);
+    }
+  }
+  /* Mod+drag moves the master split; owner_events is off so all motion comes to the root */
+  XUngrabButton(dpy, AnyButton, AnyModifier, root);
+  for (size_t j = 0; j < sizeof(lockVariants) / sizeof(lockVariants[0]); j++) {
+    XGrabButton(dpy, Button1, MOD_KEY | lockVariants[j], root, False,
+                ButtonPressMask | ButtonReleaseMask | PointerMotionMask, GrabModeAsync,
+                GrabModeAsync, None, None);
+  }
+}
+static void handleMappingNotify(XEvent *e) {
+  XMappingEvent *ev = &e->xmapping;
+  XRefreshKeyboardMapping(ev);
+  if (ev->request == MappingKeyboard || ev->request == MappingModifier) grabKeys();
 }
 static void run(void) {
   XEvent e;
-  fd_set fds;
-  int xfd = ConnectionNumber(dpy);
-
-  struct timeval last_draw, now;
-  gettimeofday(&last_draw, NULL);
-
+  drawStatusBar();
+#ifdef DEBUG_WAKEUPS
+  wakeupsSince = time(NULL);
+#endif
   while (running) {
+    if (XPending(dpy)) metrics.bursts++;
     while (XPending(dpy)) {
       XNextEvent(dpy, &e);
+#ifdef DEBUG_ROUNDTRIPS
+      currentEvent = e.type < LASTEvent ? e.type : 0;
+#endif
+      unsigned long firstRequest  = NextRequest(dpy);
+      unsigned char desktopBefore = currentDesktop;
+      Window focusBefore          = modelFocus();
+      struct timespec start;
+      clock_gettime(CLOCK_MONOTONIC, &start);
       switch (e.type) {
         case KeyPress:
           handleKeyPress(&e);
@@ -216,9 +1781,6 @@ static void run(void) {
         case MapRequest:
           handleMapRequest(&e);
           break;
-        case MapNotify:
-          handleMapNotify(&e);
-          break;
         case UnmapNotify:
           handleUnmapNotify(&e);
           break;
@@ -228,20 +1790,93 @@ static void run(void) {
         case ConfigureNotify:
           handleConfigureNotify(&e);
           break;
+        case Expose:
+          handleExpose(&e);
+          break;
+        case FocusIn:
+          handleFocusIn(&e);
+          break;
+        case PropertyNotify:
+          handlePropertyNotify(&e);
+          break;
+        case MappingNotify:
+          handleMappingNotify(&e);
+          break;
+        case ClientMessage:
+          handleClientMessage(&e);
+          break;
+        case ButtonPress:
+          handleButtonPress(&e);
+          break;
+        case ButtonRelease:
+          handleButtonRelease(&e);
+          break;
+        case MotionNotify:
+          handleMotionNotify(&e);
+          break;
+        default:
+#ifdef USE_XRANDR
+          if (randrEventBase >= 0 && (e.type == randrEventBase + RRScreenChangeNotify ||
+                                      e.type == randrEventBase + RRNotify)) {
+            XRRUpdateConfiguration(&e);
+            monitorsDirty = 1;
+          }
+#endif
+          break;
       }
+      /* once the queue is drained; the reply may bring more events, which the loop handles */
+      if (monitorsDirty && !QLength(dpy)) updateMonitors();
+      recordEvent(e.type < LASTEvent ? e.type : 0, e.xany.window, &start, firstRequest,
+                  desktopBefore, focusBefore);
     }
-    gettimeofday(&now, NULL);
-    long elapsed = (now.tv_sec - last_draw.tv_sec) * 1000000L + (now.tv_usec - last_draw.tv_usec);
-    if (elapsed >= 500000L) {
+    recordFlush();
+    XFlush(dpy);
+    /* the flush may have read events while waiting on a reply; poll() would not see them */
+    if (QLength(dpy)) continue;
+    if (poll(pollfds, POLL_COUNT, -1) < 0) continue;
+#ifdef DEBUG_WAKEUPS
+    wakeups++;
+    time_t t = time(NULL);
+    if (t - wakeupsSince >= 60) {
+      fprintf(stderr, "mwm: %lu wakeups/min\n", wakeups * 60 / (t - wakeupsSince));
+      wakeups      = 0;
+      wakeupsSince = t;
+    }
+#endif
+    if (pollfds[POLL_TIMER].revents & POLLIN) {
+      uint64_t expirations;
+      if (read(pollfds[POLL_TIMER].fd, &expirations, sizeof(expirations)) < 0) {
+        setupModules();
+      } else {
+        advanceModules();
+      }
       drawStatusBar();
-      last_draw = now;
     }
-    struct timeval timeout;
-    timeout.tv_sec  = 0;
-    timeout.tv_usec = 100000;
-    FD_ZERO(&fds);
-    FD_SET(xfd, &fds);
-    select(xfd + 1, &fds, NULL, NULL, &timeout);
+    if (pollfds[POLL_UEVENT].revents & POLLIN) handleUevent();
+    if (pollfds[POLL_OSD].revents & POLLIN) handleOsdMessage();
+    if (pollfds[POLL_CTL].revents & POLLIN) handleControlMessage();
+    if (pollfds[POLL_FRAME].revents & POLLIN) {
+      uint64_t expirations;
+      if (read(pollfds[POLL_FRAME].fd, &expirations, sizeof(expirations)) > 0) applyDrag();
+    }
+    if (pollfds[POLL_OSD_TIMER].revents & POLLIN) {
+      uint64_t expirations;
+      if (read(pollfds[POLL_OSD_TIMER].fd, &expirations, sizeof(expirations)) > 0) {
+        XUnmapWindow(dpy, osdWin);
+      }
+    }
+    if (pollfds[POLL_SIGNAL].revents & POLLIN) {
+      struct signalfd_siginfo si;
+      while (read(pollfds[POLL_SIGNAL].fd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGTERM || si.ssi_signo == SIGINT) running = 0;
+        if (si.ssi_signo == SIGUSR1) dumpMetrics();
+        if (si.ssi_signo == SIGUSR2) dumpTrace();
+        if (si.ssi_signo == SIGHUP) keyRestart(NULL);
+      }
+      /* SIGCHLD coalesces, so reap everything that has exited */
+      pid_t pid;
+      while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) releasePool(pid, None);
+    }
   }
 }
 static void handleConfigureNotify(XEvent *e) {
@@ -249,288 +1884,1089 @@ static void handleConfigureNotify(XEvent *e) {
   if (ev->window == root) {
     screen_width  = ev->width;
     screen_height = ev->height;
-    tileWindows();
+    /* with RandR the monitors follow its own events instead */
+    if (randrEventBase < 0) monitorsDirty = 1;
   }
 }
 static void killFocusedWindow(void) {
-  Desktop *d = &desktops[currentDesktop];
-  if (d->windowCount <= 0) return;
-  Window win = d->windows[d->focusedIdx];
-  if (win == None || win == root) return;
-  Atom *p;
+  Client *c = desktops[currentDesktop].focused;
+  if (!c) return;
+  queueOp((XOp){.type = c->canDelete ? OP_CLOSE : OP_KILL, .win = c->win});
+}
+static void updateProtocols(Client *c) {
+  Atom *protocols;
   int n;
-  Atom del = XInternAtom(dpy, "WM_DELETE_WINDOW", False);
-  if (XGetWMProtocols(dpy, win, &p, &n)) {
-    while (n--)
-      if (p[n] == del) goto send;
-    XKillClient(dpy, win);
-    XFree(p);
+  c->canDelete = 0;
+  if (!ROUNDTRIP(XGetWMProtocols(dpy, c->win, &protocols, &n))) return;
+  while (n--) {
+    if (protocols[n] == atoms[WMDelete]) c->canDelete = 1;
+  }
+  XFree(protocols);
+}
+static void handlePropertyNotify(XEvent *e) {
+  XPropertyEvent *ev = &e->xproperty;
+  if (ev->atom != atoms[WMProtocols]) return;
+  Client *c = findClient(ev->window);
+  if (c) updateProtocols(c);
+}
+/*
+ * A drag only records the newest pointer position. It is turned into a relayout at most once
+ * per frame, either right away or when POLL_FRAME fires, so clients see one configure per frame
+ * however fast the pointer moves.
+ */
+static void applyDrag(void) {
+  if (dragX < 0) return;
+  /* RandR may have taken the monitor away mid-drag */
+  XRectangle *a = &monitors[dragMonitor < monitorCount ? dragMonitor : currentMonitor].area;
+  resizeDelta   = dragX - (a->x + a->width / 2);
+  dragX         = -1;
+  clock_gettime(CLOCK_MONOTONIC, &lastFrame);
+  markLayoutDirty();
+}
+static void handleButtonPress(XEvent *e) {
+  dragging    = 1;
+  dragX       = e->xbutton.x_root;
+  dragMonitor = monitorAt(e->xbutton.x_root, e->xbutton.y_root);
+  applyDrag();
+}
+static void handleButtonRelease(XEvent *e) {
+  if (!dragging) return;
+  struct itimerspec its = {0};
+  timerfd_settime(pollfds[POLL_FRAME].fd, 0, &its, NULL);
+  dragging = 0;
+  dragX    = e->xbutton.x_root;
+  applyDrag();
+}
+static void handleMotionNotify(XEvent *e) {
+  if (!dragging) return;
+  XEvent next;
+  /* only the newest of a run of queued motions matters */
+  while (QLength(dpy) && (XPeekEvent(dpy, &next), next.type == MotionNotify)) {
+    XNextEvent(dpy, e);
+    metrics.motionsDropped++;
+  }
+  dragX           = e->xmotion.x_root;
+  long sinceFrame = elapsedNs(&lastFrame);
+  if (sinceFrame >= FRAME_NS) {
+    applyDrag();
     return;
   }
-  XEvent ev;
-send:
-  for (long unsigned int i = 0; i < sizeof(ev) / sizeof(long); i++) {
-    ((long *)&ev)[i] = 0;
-  }
-  ev.type                 = ClientMessage;
-  ev.xclient.window       = win;
-  ev.xclient.message_type = XInternAtom(dpy, "WM_PROTOCOLS", False);
-  ev.xclient.format       = 32;
-  ev.xclient.data.l[0]    = del;
-  ev.xclient.data.l[1]    = CurrentTime;
-  XSendEvent(dpy, win, False, NoEventMask, &ev);
-  XFree(p);
-  XFlush(dpy);
+  struct itimerspec its = {.it_value = {0, FRAME_NS - sinceFrame}};
+  timerfd_settime(pollfds[POLL_FRAME].fd, 0, &its, NULL);
+}
+/* pagers switch desktops and activate windows by sending these to the root */
+static void handleClientMessage(XEvent *e) {
+  XClientMessageEvent *ev = &e->xclient;
+  if (ev->message_type == atoms[NetCurrentDesktop]) {
+    switchDesktop(ev->data.l[0]);
+  } else if (ev->message_type == atoms[NetActiveWindow]) {
+    Client *c = findClient(ev->window);
+    if (!c) return;
+    switchDesktop(c->desktop);
+    desktops[c->desktop].focused = c;
+    focusDirty                   = 1;
+  }
+}
+static void handleFocusIn(XEvent *e) {
+  XFocusChangeEvent *ev = &e->xfocus;
+  if (ev->mode == NotifyGrab || ev->mode == NotifyUngrab || ev->detail == NotifyPointer) return;
+  inputFocus = ev->window;
 }
 static void focusCycleWindow(int direction) {
   Desktop *d = &desktops[currentDesktop];
   if (d->windowCount > 1) {
-    d->focusedIdx = (d->focusedIdx + direction + d->windowCount) % d->windowCount;
-    focusWindow(d->windows[d->focusedIdx]);
+    Client *c = d->focused;
+    if (direction > 0) {
+      d->focused = c->next ? c->next : d->head;
+    } else {
+      d->focused = c->prev ? c->prev : d->tail;
+    }
+    focusDirty = 1;
   }
 }
 static void handleKeyPress(XEvent *e) {
   XKeyEvent *ev      = &e->xkey;
-  KeySym keysym      = XkbKeycodeToKeysym(dpy, ev->keycode, 0, 0);
-  unsigned int state = ev->state;
-  if (keysym == XK_q && state == (MOD_KEY | ShiftMask)) {
-    running = 0;
-    return;
+  unsigned int state = ev->state & ~(LockMask | numlockMask);
+  if (state & ~(ShiftMask | ControlMask | Mod1Mask | Mod4Mask)) return;
+  unsigned char idx = keyTable[ev->keycode][modIndex(state)];
+  if (idx) bindings[idx - 1].func(&bindings[idx - 1].arg);
+}
+static void keyQuit(const Arg *arg) {
+  (void)arg;
+  running = 0;
+}
+static void keyRestart(const Arg *arg) {
+  (void)arg;
+  restarting = 1;
+  running    = 0;
+}
+static void keyResize(const Arg *arg) {
+  /* held keys repeat faster than we relayout, the deltas add up until the next flush */
+  int delta = resizeDelta + arg->i;
+  /* beyond this tileMonitor clamps the split even on the widest monitor, and short would wrap */
+  int limit = 0;
+  for (unsigned char i = 0; i < monitorCount; i++) {
+    int width = monitors[i].area.width;
+    if (width / 2 - splitMargin(width) > limit) limit = width / 2 - splitMargin(width);
   }
-  if ((keysym == XK_h || keysym == XK_l) && state == (MOD_KEY | ShiftMask)) {
-    resizeDelta += (keysym == XK_l) ? RESIZE_STEP : -RESIZE_STEP;
-    tileWindows();
+  if (delta > limit) delta = limit;
+  if (delta < -limit) delta = -limit;
+  resizeDelta = delta;
+  markLayoutDirty();
+}
+static void keyKill(const Arg *arg) {
+  (void)arg;
+  killFocusedWindow();
+}
+static void keyFocus(const Arg *arg) { focusCycleWindow(arg->i); }
+static void keyView(const Arg *arg) { switchDesktop(arg->i); }
+static void keyMonitor(const Arg *arg) {
+  focusMonitor(((currentMonitor + arg->i) % monitorCount + monitorCount) % monitorCount);
+}
+static void keyMove(const Arg *arg) {
+  /* inputFocus lags behind until the next flush, the model's focus does not */
+  Client *c = desktops[currentDesktop].focused;
+  if (c) moveWindowToDesktop(c->win, arg->i);
+}
+static void keySpawn(const Arg *arg) { spawn(arg->cmd); }
+static void keyTerminal(const Arg *arg) {
+  for (int i = 0; i < TERMINAL_POOL; i++) {
+    if (pool[i].win == None) continue;
+    Window win = pool[i].win;
+    pool[i]    = (PoolSlot){0, None};
+    mapWindowToDesktop(win, NULL);
+    refillPool();
     return;
   }
-  if (keysym == XK_q && state == MOD_KEY) {
-    killFocusedWindow();
-    return;
+  spawn(arg->cmd);
+  poolFailures = 0;
+  refillPool();
+}
+/*
+ * Pool terminals are spawned directly, so the pid we get back is the one the terminal puts in
+ * _NET_WM_PID. Their MapRequest is swallowed, leaving them started but unmapped until
+ * Mod+Return hands one to mapWindowToDesktop().
+ */
+static void refillPool(void) {
+  for (int i = 0; i < TERMINAL_POOL && poolFailures < POOL_MAX_FAILURES; i++) {
+    if (pool[i].pid) continue;
+    pool[i] = (PoolSlot){spawn(TERMINAL), None};
+    if (pool[i].pid < 0) {
+      pool[i].pid = 0;
+      poolFailures++;
+    }
   }
-  if ((keysym == XK_j || keysym == XK_k) && state == MOD_KEY) {
-    focusCycleWindow(keysym == XK_j ? 1 : -1);
-    return;
+}
+static _Bool claimForPool(Window win) {
+  int waiting = -1;
+  for (int i = 0; i < TERMINAL_POOL; i++) {
+    if (pool[i].pid && pool[i].win == None) waiting = i;
+  }
+  if (waiting < 0) return 0;
+  Atom type;
+  int format;
+  unsigned long n, after;
+  unsigned char *data = NULL;
+  pid_t pid           = 0;
+  if (ROUNDTRIP(XGetWindowProperty(dpy, win, atoms[NetWMPid], 0, 1, False, XA_CARDINAL, &type,
+                                   &format, &n, &after, &data)) == Success &&
+      format == 32 && n == 1) {
+    pid = *(long *)data;
   }
-  if (keysym >= XK_1 && keysym <= XK_9) {
-    unsigned char num = keysym - XK_1;
-    Window focused;
-    int revert_to;
-    XGetInputFocus(dpy, &focused, &revert_to);
-    if (state == MOD_KEY) {
-      switchDesktop(num);
-    } else if (state == (MOD_KEY | ShiftMask) && focused != None && focused != root) {
-      moveWindowToDesktop(focused, num);
+  if (data) XFree(data);
+  for (int i = 0; i < TERMINAL_POOL; i++) {
+    if (pid && pool[i].pid == pid && pool[i].win == None) {
+      pool[i].win  = win;
+      poolFailures = 0;
+      return 1;
     }
-    return;
   }
-  const size_t launcherCount = sizeof(launchers) / sizeof(launchers[0]);
-  for (size_t i = 0; i < launcherCount; i++) {
-    if (keysym == launchers[i].keysym && state == MOD_KEY) {
-      if (fork() == 0) {
-        setsid();
-        close(0);
-        close(1);
-        close(2);
-        int devnull = open("/dev/null", O_RDWR);
-        if (devnull >= 0) {
-          dup2(devnull, STDIN_FILENO);
-          dup2(devnull, STDOUT_FILENO);
-          dup2(devnull, STDERR_FILENO);
-          if (devnull > 2) close(devnull);
-        }
-        execl("/bin/sh", "sh", "-c", launchers[i].command, NULL);
-        _exit(EXIT_FAILURE);
+  return 0;
+}
+/* a pool terminal exited or lost its window before it was used */
+static void releasePool(pid_t pid, Window win) {
+  for (int i = 0; i < TERMINAL_POOL; i++) {
+    if (!pool[i].pid || (pool[i].pid != pid && (win == None || pool[i].win != win))) continue;
+    pool[i] = (PoolSlot){0, None};
+    poolFailures++;
+    refillPool();
+  }
+}
+static void setupSpawn(void) {
+  /* children must not inherit the X connection or the signals blocked for signalfd */
+  fcntl(ConnectionNumber(dpy), F_SETFD, FD_CLOEXEC);
+  sigset_t none;
+  sigemptyset(&none);
+  posix_spawnattr_init(&spawnAttr);
+  posix_spawnattr_setsigmask(&spawnAttr, &none);
+  posix_spawnattr_setflags(&spawnAttr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSID);
+  posix_spawn_file_actions_init(&spawnActions);
+  posix_spawn_file_actions_addopen(&spawnActions, STDIN_FILENO, "/dev/null", O_RDWR, 0);
+  posix_spawn_file_actions_adddup2(&spawnActions, STDIN_FILENO, STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&spawnActions, STDIN_FILENO, STDERR_FILENO);
+}
+static pid_t spawn(const char *cmd) {
+  char buf[256];
+  char *argv[MAX_SPAWN_ARGS + 1];
+  int argc = 0;
+  /* plain "prog arg..." commands are exec'd directly, anything fancier goes through sh */
+  if (strlen(cmd) < sizeof(buf) && !strpbrk(cmd, SHELL_CHARS)) {
+    strcpy(buf, cmd);
+    for (char *tok = strtok(buf, " \t"); tok; tok = strtok(NULL, " \t")) {
+      if (argc == MAX_SPAWN_ARGS) {
+        argc = 0;
+        break;
       }
-      return;
+      argv[argc++] = tok;
     }
   }
+  if (argc == 0) {
+    argv[argc++] = "sh";
+    argv[argc++] = "-c";
+    argv[argc++] = (char *)cmd;
+  }
+  argv[argc] = NULL;
+  pid_t pid;
+  return posix_spawnp(&pid, argv[0], &spawnActions, &spawnAttr, argv, environ) ? -1 : pid;
+}
+static Client *allocClient(void) {
+  if (!freeClients) {
+    Client **slabs = realloc(clientSlabs, (clientSlabCount + 1) * sizeof(*slabs));
+    if (!slabs) return NULL;
+    clientSlabs = slabs;
+    Client *slab = calloc(CLIENT_SLAB_SIZE, sizeof(*slab));
+    if (!slab) return NULL;
+    clientSlabs[clientSlabCount++] = slab;
+    for (size_t i = 0; i < CLIENT_SLAB_SIZE; i++) {
+      slab[i].next = freeClients;
+      freeClients  = &slab[i];
+    }
+  }
+  Client *c   = freeClients;
+  freeClients = c->next;
+  return c;
+}
+static void freeClient(Client *c) {
+  c->next     = freeClients;
+  freeClients = c;
+}
+static void attachClient(Client *c, unsigned char desktop) {
+  Desktop *d = &desktops[desktop];
+  c->desktop = desktop;
+  c->prev    = d->tail;
+  c->next    = NULL;
+  if (d->tail) {
+    d->tail->next = c;
+  } else {
+    d->head = c;
+  }
+  d->tail = c;
+  if (!d->focused) d->focused = c;
+  d->windowCount++;
 }
-static inline int detachWindowFromDesktop(Window w, Desktop *d) {
-  return detachWindow(w, d->windows, &d->windowCount, &d->focusedIdx, NULL);
+static void detachClient(Client *c) {
+  Desktop *d = &desktops[c->desktop];
+  if (d->focused == c) d->focused = c->next ? c->next : c->prev;
+  if (c->prev) {
+    c->prev->next = c->next;
+  } else {
+    d->head = c->next;
+  }
+  if (c->next) {
+    c->next->prev = c->prev;
+  } else {
+    d->tail = c->prev;
+  }
+  c->prev = c->next = NULL;
+  d->windowCount--;
+}
+static inline size_t clientHash(Window w, size_t size) {
+  return (size_t)((w * 0x9E3779B97F4A7C15ULL) >> 32) & (size - 1);
+}
+static Client *findClient(Window w) {
+  for (size_t i = clientHash(w, clientIndexSize);; i = (i + 1) & (clientIndexSize - 1)) {
+    if (!clientIndex[i]) return NULL;
+    if (clientIndex[i]->win == w) return clientIndex[i];
+  }
+}
+static void insertIndex(Client **table, size_t size, Client *c) {
+  size_t i = clientHash(c->win, size);
+  while (table[i]) i = (i + 1) & (size - 1);
+  table[i] = c;
+}
+static void indexClient(Client *c) {
+  if ((clientIndexUsed + 1) * 2 > clientIndexSize) {
+    size_t size    = clientIndexSize * 2;
+    Client **table = calloc(size, sizeof(*table));
+    if (!table) die("out of memory");
+    for (size_t i = 0; i < clientIndexSize; i++) {
+      if (clientIndex[i]) insertIndex(table, size, clientIndex[i]);
+    }
+    free(clientIndex);
+    clientIndex     = table;
+    clientIndexSize = size;
+  }
+  insertIndex(clientIndex, clientIndexSize, c);
+  clientIndexUsed++;
+}
+static void unindexClient(Client *c) {
+  size_t mask = clientIndexSize - 1;
+  size_t hole = clientHash(c->win, clientIndexSize);
+  while (clientIndex[hole] != c) hole = (hole + 1) & mask;
+  /* backward-shift deletion keeps probe chains intact without tombstones */
+  size_t i = (hole + 1) & mask;
+  while (clientIndex[i]) {
+    size_t home = clientHash(clientIndex[i]->win, clientIndexSize);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      clientIndex[hole] = clientIndex[i];
+      hole              = i;
+    }
+    i = (i + 1) & mask;
+  }
+  clientIndex[hole] = NULL;
+  clientIndexUsed--;
 }
 static void moveWindowToDesktop(Window win, unsigned char desktop) {
   if (desktop >= MAX_DESKTOPS || desktop == currentDesktop) return;
-  Desktop *target = &desktops[desktop];
-  if (target->windowCount >= MAX_WINDOWS_PER_DESKTOP) return;
-  Desktop *current = &desktops[currentDesktop];
-  short windowIdx  = -1;
-  for (unsigned char i = 0; i < current->windowCount; i++) {
-    if (current->windows[i] == win) {
-      windowIdx = i;
-      break;
-    }
+  Client *c = findClient(win);
+  if (!c || c->desktop != currentDesktop) return;
+  detachClient(c);
+  attachClient(c, desktop);
+  if (monitorOf(desktop) < 0) {
+    hideClient(c);
+    commitClient(c);
   }
-  if (windowIdx == -1) return;
-  _Bool wasMapped = current->isMapped[windowIdx];
-  if (!detachWindowFromDesktop(win, current)) return;
-  int newIdx               = target->windowCount;
-  target->windows[newIdx]  = win;
-  target->isMapped[newIdx] = wasMapped;
-  target->windowCount++;
-  XUnmapWindow(dpy, win);
-  tileWindows();
+  queueOp((XOp){.type = OP_DESKTOP, .win = win, .value = desktop});
+  markLayoutDirty();
 }
 inline static void focusWindow(Window w) {
-  XSetInputFocus(dpy, w, RevertToParent, CurrentTime);
-  for (unsigned char d = 0; d < MAX_DESKTOPS; d++) {
-    Desktop *desk = &desktops[d];
-    for (unsigned char i = 0; i < desk->windowCount; i++) {
-      unsigned long color = (desk->windows[i] == w) ? COLOR_A : COLOR_B;
-      XSetWindowBorderWidth(dpy, desk->windows[i], BORDER_WIDTH);
-      XSetWindowBorder(dpy, desk->windows[i], color);
+  queueOp((XOp){.type = OP_FOCUS, .win = w});
+  inputFocus = w;
+  for (unsigned char i = 0; i < monitorCount; i++) {
+    for (Client *c = desktops[monitors[i].desktop].head; c; c = c->next) {
+      c->want.borderWidth = BORDER_WIDTH;
+      c->want.borderColor = (c->win == w) ? COLOR_A : COLOR_B;
+      commitClient(c);
     }
   }
 }
-static void handleUnmapNotify(XEvent *e) {
-  Window win = e->xunmap.window;
-  Desktop *d = &desktops[currentDesktop];
-  for (unsigned char i = 0; i < d->windowCount; i++) {
-    if (d->windows[i] == win) {
-      d->isMapped[i] = 0;
-      XUnmapWindow(dpy, win);
-      if (i == d->focusedIdx && d->windowCount > 1) {
-        d->focusedIdx = (i + 1) % d->windowCount;
-        focusWindow(d->windows[d->focusedIdx]);
+/*
+ * Parked windows stay mapped just left of the screen, so switching back moves them instead of
+ * mapping them, and applications keep their contents instead of redrawing from scratch.
+ */
+static void hideClient(Client *c) {
+  c->want.wmState = IconicState;
+  if (PARK_HIDDEN && c->have.mapped) {
+    c->want.x = -(c->want.w + 2 * c->want.borderWidth);
+  } else {
+    c->want.mapped = 0;
+  }
+}
+static void commitClient(Client *c) {
+  unsigned int mask = 0;
+  if (c->want.x != c->have.x) mask |= CWX;
+  if (c->want.y != c->have.y) mask |= CWY;
+  if (c->want.w != c->have.w) mask |= CWWidth;
+  if (c->want.h != c->have.h) mask |= CWHeight;
+  if (c->want.borderWidth != c->have.borderWidth) mask |= CWBorderWidth;
+  if (mask) {
+    queueOp((XOp){.type = OP_CONFIGURE,
+                  .mask = mask,
+                  .win  = c->win,
+                  .wc   = {.x            = c->want.x,
+                           .y            = c->want.y,
+                           .width        = c->want.w,
+                           .height       = c->want.h,
+                           .border_width = c->want.borderWidth}});
+    metrics.configures++;
+  }
+  if (c->want.borderColor != c->have.borderColor) {
+    queueOp((XOp){.type = OP_BORDER, .win = c->win, .value = c->want.borderColor});
+  }
+  if (c->want.mapped != c->have.mapped) {
+    queueOp((XOp){.type = c->want.mapped ? OP_MAP : OP_UNMAP, .win = c->win});
+    if (!c->want.mapped) c->ignoreUnmap++;
+    /* a mapped window goes on top of its siblings, so the floats below it need raising again */
+    if (c->want.mapped) {
+      for (Client *f = desktops[c->desktop].head; f; f = f->next) f->raised = 0;
+      c->raised = 1;
+    }
+  }
+  if (c->want.wmState != c->have.wmState) {
+    queueOp((XOp){.type = OP_WM_STATE, .win = c->win, .value = c->want.wmState});
+  }
+  c->have = c->want;
+}
+static void withdrawClient(Window win) {
+  Client *c = findClient(win);
+  if (!c) return;
+  if (c->ignoreUnmap) {
+    c->ignoreUnmap--;
+    return;
+  }
+  queueOp((XOp){.type = OP_WITHDRAW, .win = win});
+  unmanageClient(c);
+}
+static void handleUnmapNotify(XEvent *e) { withdrawClient(e->xunmap.window); }
+static void queueOp(XOp op) {
+  if (opCount == OP_QUEUE) applyOps();
+  ops[opCount++] = op;
+}
+static void applyOps(void) {
+  for (unsigned int i = 0; i < opCount; i++) {
+    XOp *op = &ops[i];
+    if (replaying) {
+      opTotals[op->type]++;
+      /* stands in for the UnmapNotify the server sends back */
+      Client *c = op->type == OP_UNMAP ? findClient(op->win) : NULL;
+      if (c && c->ignoreUnmap) c->ignoreUnmap--;
+      continue;
+    }
+    switch (op->type) {
+      case OP_CONFIGURE:
+        XConfigureWindow(dpy, op->win, op->mask, &op->wc);
+        break;
+      case OP_BORDER:
+        XSetWindowBorder(dpy, op->win, op->value);
+        break;
+      case OP_MAP:
+        XMapWindow(dpy, op->win);
+        break;
+      case OP_UNMAP:
+        XUnmapWindow(dpy, op->win);
+        break;
+      case OP_WM_STATE: {
+        long data[] = {op->value, None};
+        XChangeProperty(dpy, op->win, atoms[WMState], atoms[WMState], 32, PropModeReplace,
+                        (unsigned char *)data, 2);
+        break;
       }
-      for (unsigned char j = i; j < d->windowCount - 1; j++) {
-        d->windows[j]  = d->windows[j + 1];
-        d->isMapped[j] = d->isMapped[j + 1];
+      case OP_DESKTOP:
+        XChangeProperty(dpy, op->win, atoms[NetWMDesktop], XA_CARDINAL, 32, PropModeReplace,
+                        (unsigned char *)&op->value, 1);
+        break;
+      case OP_MANAGE:
+        XSelectInput(dpy, op->win, PropertyChangeMask | FocusChangeMask);
+        XChangeProperty(dpy, root, atoms[NetClientList], XA_WINDOW, 32, PropModeAppend,
+                        (unsigned char *)&op->win, 1);
+        break;
+      case OP_WITHDRAW:
+        XDeleteProperty(dpy, op->win, atoms[WMState]);
+        XDeleteProperty(dpy, op->win, atoms[NetWMDesktop]);
+        break;
+      case OP_CLOSE: {
+        XEvent ev               = {.type = ClientMessage};
+        ev.xclient.window       = op->win;
+        ev.xclient.message_type = atoms[WMProtocols];
+        ev.xclient.format       = 32;
+        ev.xclient.data.l[0]    = atoms[WMDelete];
+        ev.xclient.data.l[1]    = CurrentTime;
+        XSendEvent(dpy, op->win, False, NoEventMask, &ev);
+        break;
       }
-      d->windowCount--;
-      tileWindows();
-      return;
+      case OP_KILL:
+        XKillClient(dpy, op->win);
+        break;
+      case OP_RAISE:
+        XRaiseWindow(dpy, op->win);
+        break;
+      case OP_FOCUS:
+        XSetInputFocus(dpy, op->win, RevertToParent, CurrentTime);
+        break;
+      case OP_GRAB:
+        XGrabServer(dpy);
+        break;
     }
   }
+  opCount = 0;
 }
 static void handleDestroyNotify(XEvent *e) {
-  Window win = e->xdestroywindow.window;
-  Desktop *d = &desktops[currentDesktop];
-  for (unsigned char i = 0; i < d->windowCount; i++) {
-    if (d->windows[i] == win) {
-      d->isMapped[i] = 0;
-      d->windowCount--;
-      for (unsigned char j = i; j < d->windowCount; j++) {
-        d->windows[j]  = d->windows[j + 1];
-        d->isMapped[j] = d->isMapped[j + 1];
-      }
-      tileWindows();
-      break;
+  Client *c = findClient(e->xdestroywindow.window);
+  if (c) {
+    unmanageClient(c);
+  } else {
+    releasePool(0, e->xdestroywindow.window);
+  }
+}
+/* the _MWMP_STATE items, malloc'ed; n is set to their count */
+static long *stateData(size_t *n) {
+  *n = 3;
+  for (unsigned char d = 0; d < MAX_DESKTOPS; d++) *n += SAVED_FIELDS * desktops[d].windowCount;
+  long *data = malloc(*n * sizeof(*data));
+  if (!data) return NULL;
+  data[0]  = resizeDelta;
+  data[1]  = currentDesktop;
+  data[2]  = SAVED_FIELDS;
+  size_t i = 3;
+  for (unsigned char d = 0; d < MAX_DESKTOPS; d++) {
+    for (Client *c = desktops[d].head; c; c = c->next) {
+      data[i++] = c->win;
+      data[i++] = d;
+      data[i++] = (c == desktops[d].focused ? SAVED_FOCUSED : 0) |
+                  (c->canDelete ? SAVED_CAN_DELETE : 0) |
+                  (c->floatGeometry.width ? SAVED_FLOATING : 0) |
+                  (c->have.mapped ? SAVED_MAPPED : 0);
+      data[i++] = c->floatGeometry.x;
+      data[i++] = c->floatGeometry.y;
+      data[i++] = c->floatGeometry.width;
+      data[i++] = c->floatGeometry.height;
+      data[i++] = c->have.x;
+      data[i++] = c->have.y;
+      data[i++] = c->have.w;
+      data[i++] = c->have.h;
+      data[i++] = c->have.borderWidth;
     }
   }
+  return data;
 }
-static void cleanup(void) {
+static void saveState(void) {
+  size_t n;
+  long *data = stateData(&n);
+  if (!data) return;
+  XChangeProperty(dpy, root, atoms[MwmpState], XA_CARDINAL, 32, PropModeReplace,
+                  (unsigned char *)data, n);
+  free(data);
+}
+static int compareWindows(const void *a, const void *b) {
+  Window x = *(const Window *)a, y = *(const Window *)b;
+  return (x > y) - (x < y);
+}
+static int compareLong(const void *a, const void *b) {
+  long x = *(const long *)a, y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+static long getWmState(Window w) {
+  Atom type;
+  int format;
+  unsigned long n, after;
+  unsigned char *data = NULL;
+  long state          = WithdrawnState;
+  if (ROUNDTRIP(XGetWindowProperty(dpy, w, atoms[WMState], 0, 2, False, atoms[WMState], &type,
+                                   &format, &n, &after, &data)) == Success &&
+      format == 32 && n > 0) {
+    state = *(long *)data;
+  }
+  if (data) XFree(data);
+  return state;
+}
+/* a window the server already shows as it is, e.g. after a restart */
+static void setExisting(Client *c, int x, int y, int w, int h, int borderWidth, _Bool mapped) {
+  c->have = (WinState){x, y, w, h, borderWidth, ~0UL, mapped, WithdrawnState};
+  c->want = c->have;
+}
+static void fetchExisting(Client *c) {
+  XWindowAttributes wa;
+  if (!ROUNDTRIP(XGetWindowAttributes(dpy, c->win, &wa))) return;
+  setExisting(c, wa.x, wa.y, wa.width, wa.height, wa.border_width, wa.map_state != IsUnmapped);
+}
+/*
+ * Rebuilds the desktops from _MWMP_STATE, keeping the saved windows found in the sorted windows
+ * array. Where each window is on the server is saved too; fetch looks it up for states written
+ * by older instances, which saved no more than the first seven fields.
+ */
+static void restoreState(const unsigned long *saved, unsigned long n, const Window *windows,
+                         unsigned int count, void (*fetch)(Client *c)) {
+  if (n) {
+    resizeDelta = (long)saved[0];
+    /* nothing is managed yet, so this only picks the monitor or what the current one shows */
+    if (saved[1] < MAX_DESKTOPS) switchDesktop(saved[1]);
+  }
+  unsigned long first = 2, fields = 3;
+  if (n > 2 && saved[2] >= 7 && saved[2] <= SAVED_FIELDS) {
+    first  = 3;
+    fields = saved[2];
+  }
+  for (unsigned long i = first; i + fields <= n; i += fields) {
+    Window win            = saved[i];
+    unsigned char desktop = saved[i + 1] < MAX_DESKTOPS ? saved[i + 1] : currentDesktop;
+    if (!count || !bsearch(&win, windows, count, sizeof(*windows), compareWindows)) continue;
+    Client *c = manageClient(win, desktop);
+    if (!c) continue;
+    c->canDelete = (saved[i + 2] & SAVED_CAN_DELETE) != 0;
+    if ((saved[i + 2] & SAVED_FLOATING) && fields >= 7) {
+      /* 32-bit property items, the casts bring back negative coordinates */
+      setFloating(c, (int)saved[i + 3], (int)saved[i + 4], saved[i + 5], saved[i + 6]);
+    } else if (saved[i + 2] & SAVED_FLOATING) {
+      placeFloating(c);
+    }
+    if (fields == SAVED_FIELDS) {
+      setExisting(c, (int)saved[i + 7], (int)saved[i + 8], (int)saved[i + 9], (int)saved[i + 10],
+                  (int)saved[i + 11], (saved[i + 2] & SAVED_MAPPED) != 0);
+    } else if (fetch) {
+      fetch(c);
+    }
+    if (saved[i + 2] & SAVED_FOCUSED) desktops[desktop].focused = c;
+    if (monitorOf(desktop) < 0) {
+      hideClient(c);
+      commitClient(c);
+    }
+  }
+}
+/*
+ * Manage windows that already exist. After a restart, the windows listed in _MWMP_STATE that
+ * are still children of the root are adopted straight from the saved state, so the scan costs
+ * two round trips no matter how many windows are open. Only windows the saved state does not
+ * know about need their attributes fetched one at a time.
+ */
+static void adoptWindows(void) {
+  Window rootReturn, parent, *children = NULL;
+  unsigned int count = 0;
+  Atom type;
+  int format;
+  unsigned long n = 0, after;
+  unsigned long *saved = NULL;
+  if (ROUNDTRIP(XGetWindowProperty(dpy, root, atoms[MwmpState], 0, LONG_MAX / 4, True,
+                                   XA_CARDINAL, &type, &format, &n, &after,
+                                   (unsigned char **)&saved)) != Success ||
+      format != 32 || n < 2) {
+    n = 0;
+  }
+  ROUNDTRIP(XQueryTree(dpy, root, &rootReturn, &parent, &children, &count));
+  if (count) qsort(children, count, sizeof(*children), compareWindows);
+  restoreState(saved, n, children, count, fetchExisting);
+  for (unsigned int i = 0; i < count; i++) {
+    XWindowAttributes wa;
+    if (findClient(children[i])) continue;
+    if (!ROUNDTRIP(XGetWindowAttributes(dpy, children[i], &wa)) || wa.override_redirect) continue;
+    if (wa.map_state == IsViewable || getWmState(children[i]) == IconicState) {
+      mapWindowToDesktop(children[i], &wa);
+    }
+  }
+  if (saved) XFree(saved);
+  if (children) XFree(children);
+  markLayoutDirty();
+}
+/*
+ * On quit every window is unmapped for the next window manager. Windows that are parked, or
+ * whose position is unknown, are moved onto the current monitor first, or the next window
+ * manager would map them off-screen. That includes parked windows of a desktop a new monitor
+ * shows since the last relayout.
+ */
+static void releaseClients(void) {
+  XRectangle *a = &monitors[currentMonitor].area;
   for (unsigned char d = 0; d < MAX_DESKTOPS; d++) {
-    for (unsigned char i = 0; i < desktops[d].windowCount; i++) {
-      XUnmapWindow(dpy, desktops[d].windows[i]);
+    for (Client *c = desktops[d].head; c; c = c->next) {
+      if (c->have.x < 0) {
+        c->want.x = c->floatGeometry.width ? c->floatGeometry.x : a->x + GAP_SIZE;
+        if (c->have.y == INT_MIN) c->want.y = a->y + GAP_SIZE;
+      }
+      c->want.mapped = 0;
+      commitClient(c);
     }
   }
+  applyOps();
+}
+static void cleanup(void) {
+  applyOps();
+  /* unused pool terminals are invisible, and a restarted instance could not tell them apart */
+  for (int i = 0; i < TERMINAL_POOL; i++) {
+    if (pool[i].pid) kill(pool[i].pid, SIGTERM);
+  }
+  if (restarting) {
+    saveState();
+  } else {
+    releaseClients();
+    XDeleteProperty(dpy, root, atoms[NetClientList]);
+    XDeleteProperty(dpy, root, atoms[NetActiveWindow]);
+  }
+  posix_spawnattr_destroy(&spawnAttr);
+  posix_spawn_file_actions_destroy(&spawnActions);
+#ifdef DEBUG_ROUNDTRIPS
+  for (int i = 0; i < LASTEvent; i++) {
+    if (roundTrips[i]) fprintf(stderr, "mwm: event %d made %lu round trips\n", i, roundTrips[i]);
+  }
+#endif
+  cleanupCore();
+  if (barFont) XFreeFontInfo(NULL, barFont, 1);
+  XFreePixmap(dpy, barBuf);
+  XFreeGC(dpy, barGC);
+  for (unsigned char i = 0; i < barCount; i++) XDestroyWindow(dpy, bars[i]);
+  XDestroyWindow(dpy, osdWin);
+  if (pollfds[POLL_OSD].fd >= 0) unlink(osdAddr.sun_path);
+  if (pollfds[POLL_CTL].fd >= 0) unlink(ctlAddr.sun_path);
+  for (int i = POLL_TIMER; i < POLL_COUNT; i++) {
+    if (pollfds[i].fd >= 0) close(pollfds[i].fd);
+  }
+  closeBatteries();
+  closeModules();
   XCloseDisplay(dpy);
 }
+static inline void markLayoutDirty(void) {
+  layoutDirty = 1;
+  metrics.layoutRequests++;
+}
+static void flushLayout(void) {
+  Client *focused = desktops[currentDesktop].focused;
+  _Bool relayout  = layoutDirty;
+  if (layoutDirty) {
+    tileWindows();
+  } else if (focusDirty && focused) {
+    focusWindow(focused->win);
+  }
+  layoutDirty = focusDirty = 0;
+  applyOps();
+  if (!replaying) {
+    if (relayout) {
+      refreshModules(updateDesktop);
+      drawStatusBar();
+    }
+    publishEwmh();
+    if (serverGrabbed) XUngrabServer(dpy);
+  }
+  serverGrabbed = 0;
+}
+static void setupEwmh(void) {
+  long count        = MAX_DESKTOPS;
+  const char name[] = "mwmp";
+  Atom *supported   = &atoms[NetSupported];
+  XChangeProperty(dpy, root, atoms[NetSupported], XA_ATOM, 32, PropModeReplace,
+                  (unsigned char *)supported, AtomCount - NetSupported);
+  XChangeProperty(dpy, root, atoms[NetNumberOfDesktops], XA_CARDINAL, 32, PropModeReplace,
+                  (unsigned char *)&count, 1);
+  /* the bar window doubles as the check window that tells pagers an EWMH WM is running */
+  XChangeProperty(dpy, root, atoms[NetSupportingWMCheck], XA_WINDOW, 32, PropModeReplace,
+                  (unsigned char *)&bars[0], 1);
+  XChangeProperty(dpy, bars[0], atoms[NetSupportingWMCheck], XA_WINDOW, 32, PropModeReplace,
+                  (unsigned char *)&bars[0], 1);
+  XChangeProperty(dpy, bars[0], atoms[NetWMName], atoms[Utf8String], 8, PropModeReplace,
+                  (const unsigned char *)name, sizeof(name) - 1);
+  /* managing a client appends to the list, so start from an empty one */
+  XDeleteProperty(dpy, root, atoms[NetClientList]);
+}
+/*
+ * Managing a client appends it to _NET_CLIENT_LIST right away. Everything else, including the
+ * rewrite of the list after clients go away, is sent here at most once per event burst.
+ */
+static void publishEwmh(void) {
+  Client *focused = desktops[currentDesktop].focused;
+  Window active   = focused ? focused->win : None;
+  if (publishedDesktop != currentDesktop) {
+    long desktop = publishedDesktop = currentDesktop;
+    XChangeProperty(dpy, root, atoms[NetCurrentDesktop], XA_CARDINAL, 32, PropModeReplace,
+                    (unsigned char *)&desktop, 1);
+  }
+  if (publishedActive != active) {
+    publishedActive = active;
+    XChangeProperty(dpy, root, atoms[NetActiveWindow], XA_WINDOW, 32, PropModeReplace,
+                    (unsigned char *)&active, 1);
+  }
+  if (!clientListDirty) return;
+  size_t n = 0;
+  for (unsigned char d = 0; d < MAX_DESKTOPS; d++) n += desktops[d].windowCount;
+  Window *list = malloc((n ? n : 1) * sizeof(*list));
+  if (!list) return;
+  n = 0;
+  for (unsigned char d = 0; d < MAX_DESKTOPS; d++) {
+    for (Client *c = desktops[d].head; c; c = c->next) list[n++] = c->win;
+  }
+  XChangeProperty(dpy, root, atoms[NetClientList], XA_WINDOW, 32, PropModeReplace,
+                  (unsigned char *)list, n);
+  free(list);
+  clientListDirty = 0;
+}
 static void tileWindows(void) {
-  Desktop *d          = &desktops[currentDesktop];
-  unsigned char count = d->windowCount;
-  if (count == 0) return;
-  if (count == 1) {
-    XMoveResizeWindow(dpy, d->windows[0], 0, 0, screen_width - 2 * BORDER_WIDTH,
-                      screen_height - STATUS_BAR_HEIGHT - 2 * BORDER_WIDTH);
-    d->isMapped[0] = 1;
-    XMapWindow(dpy, d->windows[0]);
-    focusWindow(d->windows[0]);
+  metrics.relayouts++;
+  for (unsigned char i = 0; i < monitorCount; i++) tileMonitor(&monitors[i]);
+  Client *focused = desktops[currentDesktop].focused;
+  /* an empty desktop focuses the root, parked or other monitors' windows would keep the focus */
+  focusWindow(focused ? focused->win : root);
+  /* after focusWindow committed the maps; moves and resizes leave the stacking order alone */
+  for (unsigned char i = 0; i < monitorCount; i++) {
+    for (Client *c = desktops[monitors[i].desktop].head; c; c = c->next) {
+      if (!c->floatGeometry.width || c->raised) continue;
+      queueOp((XOp){.type = OP_RAISE, .win = c->win});
+      c->raised = 1;
+    }
+  }
+}
+/* how close the split between master and stack may come to either edge of a monitor */
+static int splitMargin(int width) { return width / 2 < 100 ? width / 2 : 100; }
+static void tileMonitor(const Monitor *m) {
+  Desktop *d         = &desktops[m->desktop];
+  unsigned int count = 0;
+  Client *first      = NULL;
+  int areaX = m->area.x, areaY = m->area.y, width = m->area.width, height = m->area.height;
+  for (Client *c = d->head; c; c = c->next) {
+    if (!c->floatGeometry.width) {
+      if (!first) first = c;
+      count++;
+      continue;
+    }
+    c->want.x       = c->floatGeometry.x;
+    c->want.y       = c->floatGeometry.y;
+    c->want.w       = c->floatGeometry.width;
+    c->want.h       = c->floatGeometry.height;
+    c->want.mapped  = 1;
+    c->want.wmState = NormalState;
+  }
+  if (count <= 1) {
+    Client *c = first;
+    if (c) {
+      c->want.x       = areaX;
+      c->want.y       = areaY;
+      c->want.w       = width - 2 * BORDER_WIDTH;
+      c->want.h       = height - STATUS_BAR_HEIGHT - 2 * BORDER_WIDTH;
+      c->want.mapped  = 1;
+      c->want.wmState = NormalState;
+    }
     return;
   }
-  int masterCount  = count >= 1 ? 1 : 0;
-  int stackCount   = count - masterCount;
-  int totalGapV    = stackCount * GAP_SIZE;
-  int totalGapH    = 3 * GAP_SIZE;
-  int usableHeight = screen_height - STATUS_BAR_HEIGHT - totalGapV;
-  int masterWidth  = (screen_width + (resizeDelta << 1)) >> 1;
-  if (masterWidth < 100) masterWidth = 100;
-  if (masterWidth > screen_width - 100) masterWidth = screen_width - 100;
-  int stackWidth = screen_width - masterWidth - totalGapH;
-  masterWidth -= 2 * GAP_SIZE;
-  int masterHeight = screen_height - 0.5 * STATUS_BAR_HEIGHT - 2 * GAP_SIZE;
-  int stackHeight  = stackCount > 0 ? (usableHeight / stackCount) : 0;
-  int x, y, w, h;
-  for (unsigned char i = 0; i < count; i++) {
-    if (!d->isMapped[i]) continue;
-    if (i == 0 && masterCount == 1) {
-      x = GAP_SIZE;
-      y = GAP_SIZE;
-      w = masterWidth - 2 * BORDER_WIDTH;
-      h = masterHeight - 2 * BORDER_WIDTH;
+  int masterCount = count >= 1 ? 1 : 0;
+  int stackCount  = count - masterCount;
+  int column      = height - STATUS_BAR_HEIGHT;
+  int minHeight   = 2 * BORDER_WIDTH + 1;
+  /* narrow monitors give up the gaps between the columns first, each window keeps a pixel */
+  int gapX = (width - 4 * BORDER_WIDTH - 2) / 5;
+  if (gapX > GAP_SIZE) gapX = GAP_SIZE;
+  if (gapX < 0) gapX = 0;
+  int margin      = splitMargin(width);
+  int masterWidth = width / 2 + resizeDelta;
+  if (masterWidth < margin) masterWidth = margin;
+  if (masterWidth > width - margin) masterWidth = width - margin;
+  if (masterWidth > width - 3 * gapX - 2 * BORDER_WIDTH - 1) {
+    masterWidth = width - 3 * gapX - 2 * BORDER_WIDTH - 1;
+  }
+  if (masterWidth < 2 * gapX + 2 * BORDER_WIDTH + 1) masterWidth = 2 * gapX + 2 * BORDER_WIDTH + 1;
+  int stackWidth = width - masterWidth - 3 * gapX;
+  masterWidth -= 2 * gapX;
+  int masterHeight = height - 0.5 * STATUS_BAR_HEIGHT - 2 * GAP_SIZE;
+  /* deep stacks first give up their gaps, then overlap, so every window stays in the column */
+  int gap = column / stackCount - minHeight;
+  if (gap > GAP_SIZE) gap = GAP_SIZE;
+  if (gap < 0) gap = 0;
+  int stackHeight = (column - stackCount * gap) / stackCount;
+  if (stackHeight < minHeight) stackHeight = minHeight;
+  int step = stackHeight + gap;
+  if (stackCount > 1 && gap + (stackCount - 1) * step + stackHeight > column) {
+    step = (column - gap - stackHeight) / (stackCount - 1);
+  }
+  int i = 0;
+  for (Client *c = first; c; c = c->next) {
+    if (c->floatGeometry.width) continue;
+    if (i++ == 0 && masterCount == 1) {
+      c->want.x = areaX + gapX;
+      c->want.y = areaY + GAP_SIZE;
+      c->want.w = masterWidth - 2 * BORDER_WIDTH;
+      c->want.h = masterHeight - 2 * BORDER_WIDTH;
     } else {
-      int stackIdx = i - 1;
-      x            = masterWidth + 2 * GAP_SIZE;
-      y            = GAP_SIZE + stackIdx * (stackHeight + GAP_SIZE);
-      w            = stackWidth - 1.5 * BORDER_WIDTH;
-      h            = stackHeight - 2 * BORDER_WIDTH;
+      int stackIdx = i - 2;
+      c->want.x    = areaX + masterWidth + 2 * gapX;
+      c->want.y    = areaY + gap + stackIdx * step;
+      c->want.w    = stackWidth - 1.5 * BORDER_WIDTH;
+      c->want.h    = stackHeight - 2 * BORDER_WIDTH;
     }
-    XMoveResizeWindow(dpy, d->windows[i], x, y, w, h);
-    d->isMapped[i] = 1;
-    XMapWindow(dpy, d->windows[i]);
+    c->want.mapped  = 1;
+    c->want.wmState = NormalState;
   }
-  focusWindow(d->windows[d->focusedIdx]);
 }
-static void mapWindowToDesktop(Window win) {
-  Desktop *d = &desktops[currentDesktop];
-  if (d->windowCount < MAX_WINDOWS_PER_DESKTOP) {
-    int idx          = d->windowCount;
-    d->windows[idx]  = win;
-    d->isMapped[idx] = 1;
-    d->windowCount++;
-    d->focusedIdx = idx;
+static Client *manageClient(Window win, unsigned char desktop) {
+  if (findClient(win)) return NULL;
+  Client *c = allocClient();
+  if (!c) {
+    queueOp((XOp){.type = OP_KILL, .win = win});
+    return NULL;
+  }
+  *c = (Client){.win = win, .want = unknownState, .have = unknownState};
+  attachClient(c, desktop);
+  indexClient(c);
+  queueOp((XOp){.type = OP_MANAGE, .win = win});
+  queueOp((XOp){.type = OP_DESKTOP, .win = win, .value = desktop});
+  return c;
+}
+/* wa describes a window that is already on the server, NULL for one asking to be mapped */
+static void mapWindowToDesktop(Window win, const XWindowAttributes *wa) {
+  if (findClient(win)) return;
+  const Rule *rule = matchRule(win);
+  if (rule && (rule->flags & RULE_IGNORE)) {
     XMapWindow(dpy, win);
-    focusWindow(win);
-    tileWindows();
+    return;
+  }
+  unsigned char desktop = currentDesktop;
+  if (rule && rule->desktop && rule->desktop <= MAX_DESKTOPS) desktop = rule->desktop - 1;
+  Client *c = manageClient(win, desktop);
+  if (!c) return;
+  if (wa) {
+    setExisting(c, wa->x, wa->y, wa->width, wa->height, wa->border_width,
+                wa->map_state != IsUnmapped);
+  }
+  updateProtocols(c);
+  if (rule && (rule->flags & RULE_FLOATING)) placeFloating(c);
+  showNewClient(c);
+}
+static void showNewClient(Client *c) {
+  desktops[c->desktop].focused = c;
+  if (monitorOf(c->desktop) >= 0) {
+    markLayoutDirty();
   } else {
-    XKillClient(dpy, win);
-    XFlush(dpy);
+    /* never mapped here; it shows up when its desktop is */
+    hideClient(c);
+    commitClient(c);
   }
 }
-static void handleMapRequest(XEvent *e) {
-  XMapRequestEvent *ev = &e->xmaprequest;
-  mapWindowToDesktop(ev->window);
-}
-static inline int detachWindow(Window w, Window *windows, unsigned char *windowCount,
-                               unsigned char *focusedIdx, _Bool *isMapped) {
-  for (unsigned char i = 0; i < *windowCount; i++) {
-    if (windows[i] == w) {
-      if (i < *windowCount - 1) {
-        for (unsigned char j = i; j < *windowCount - 1; j++) {
-          windows[j]  = windows[j + 1];
-          isMapped[j] = isMapped[j + 1];
-        }
-      }
-      (*windowCount)--;
-      if (*focusedIdx >= *windowCount) *focusedIdx = *windowCount ? *windowCount - 1 : 0;
-      return 1;
-    }
+static void placeFloating(Client *c) {
+  Window rootReturn;
+  int x, y;
+  unsigned int w, h, border, depth;
+  if (!ROUNDTRIP(XGetGeometry(dpy, c->win, &rootReturn, &x, &y, &w, &h, &border, &depth))) return;
+  setFloating(c, x, y, w, h);
+}
+/*
+ * Windows at the origin were never placed, and windows outside their monitor were parked by an
+ * earlier instance or saved under another monitor layout; all of them are centred on it.
+ */
+static void setFloating(Client *c, int x, int y, unsigned int w, unsigned int h) {
+  int shown     = monitorOf(c->desktop);
+  XRectangle *a = &monitors[shown >= 0 ? shown : currentMonitor].area;
+  if ((x == 0 && y == 0) || x + (int)w <= a->x || x >= a->x + a->width || y + (int)h <= a->y ||
+      y >= a->y + a->height) {
+    x = a->x + (a->width - (int)w) / 2;
+    y = a->y + (a->height - STATUS_BAR_HEIGHT - (int)h) / 2;
   }
-  return 0;
+  c->floatGeometry = (XRectangle){x, y, w ? w : 1, h ? h : 1};
 }
-static void handleMapNotify(XEvent *e) {
-  XMapEvent *ev = &e->xmap;
-  Desktop *d    = &desktops[currentDesktop];
-  for (unsigned char i = 0; i < d->windowCount; i++) {
-    if (d->windows[i] == ev->window && !d->isMapped[i]) {
-      d->isMapped[i] = 1;
-      tileWindows();
-      break;
+static unsigned int hashString(const char *s) {
+  unsigned int h = 5381;
+  while (*s) h = h * 33 + (unsigned char)*s++;
+  return h;
+}
+/* chain rules by class hash, in table order, so a lookup only walks plausible rules */
+static void compileRules(void) {
+  char *typeNames[RULE_COUNT];
+  int typeCount = 0;
+  for (int i = RULE_COUNT - 1; i >= 0; i--) {
+    unsigned int bucket =
+        rules[i].windowClass ? hashString(rules[i].windowClass) & (RULE_BUCKETS - 1) : RULE_BUCKETS;
+    ruleNext[i]         = ruleBuckets[bucket];
+    ruleBuckets[bucket] = i + 1;
+    if (rules[i].windowClass || rules[i].instance) ruleNeeds |= NEED_CLASS;
+    if (rules[i].title) ruleNeeds |= NEED_TITLE;
+    if (rules[i].type) ruleNeeds |= NEED_TYPE;
+  }
+  for (size_t i = 0; i < RULE_COUNT; i++) {
+    if (rules[i].type) typeNames[typeCount++] = (char *)rules[i].type;
+  }
+  Atom typeAtoms[RULE_COUNT];
+  if (typeCount) ROUNDTRIP(XInternAtoms(dpy, typeNames, typeCount, False, typeAtoms));
+  for (size_t i = 0, j = 0; i < RULE_COUNT; i++) {
+    ruleTypes[i] = rules[i].type ? typeAtoms[j++] : None;
+  }
+}
+static int firstMatch(unsigned char head, int best, const XClassHint *hint, const char *title,
+                      Atom type) {
+  for (unsigned char i = head; i && i - 1 < best; i = ruleNext[i - 1]) {
+    const Rule *r = &rules[i - 1];
+    if (r->windowClass && (!hint->res_class || strcmp(r->windowClass, hint->res_class))) continue;
+    if (r->instance && (!hint->res_name || strcmp(r->instance, hint->res_name))) continue;
+    if (r->title && (!title || !strstr(title, r->title))) continue;
+    if (r->type && ruleTypes[i - 1] != type) continue;
+    return i - 1;
+  }
+  return best;
+}
+/*
+ * Only the properties some rule looks at are fetched, so an empty table costs no round trips.
+ * Xlib cannot pipeline replies, so each needed property is still one XGetWindowProperty.
+ */
+static const Rule *matchRule(Window win) {
+  if (!ruleNeeds) return NULL;
+  XClassHint hint     = {NULL, NULL};
+  char *title         = NULL;
+  Atom type           = None;
+  unsigned char *data = NULL;
+  if (ruleNeeds & NEED_CLASS) ROUNDTRIP(XGetClassHint(dpy, win, &hint));
+  if (ruleNeeds & NEED_TITLE) ROUNDTRIP(XFetchName(dpy, win, &title));
+  if (ruleNeeds & NEED_TYPE) {
+    Atom actual;
+    int format;
+    unsigned long n, after;
+    if (ROUNDTRIP(XGetWindowProperty(dpy, win, atoms[NetWMWindowType], 0, 1, False, XA_ATOM,
+                                     &actual, &format, &n, &after, &data)) == Success &&
+        format == 32 && n == 1) {
+      type = *(Atom *)data;
     }
   }
+  int best = RULE_COUNT;
+  if (hint.res_class) {
+    best = firstMatch(ruleBuckets[hashString(hint.res_class) & (RULE_BUCKETS - 1)], best, &hint,
+                      title, type);
+  }
+  best = firstMatch(ruleBuckets[RULE_BUCKETS], best, &hint, title, type);
+  if (hint.res_class) XFree(hint.res_class);
+  if (hint.res_name) XFree(hint.res_name);
+  if (title) XFree(title);
+  if (data) XFree(data);
+  return best < (int)RULE_COUNT ? &rules[best] : NULL;
+}
+static void handleMapRequest(XEvent *e) {
+  XMapRequestEvent *ev = &e->xmaprequest;
+  if (claimForPool(ev->window)) return;
+  mapWindowToDesktop(ev->window, NULL);
+}
+static void unmanageClient(Client *c) {
+  unsigned char desktop = c->desktop;
+  if (inputFocus == c->win) inputFocus = None;
+  unindexClient(c);
+  detachClient(c);
+  freeClient(c);
+  clientListDirty = 1;
+  if (monitorOf(desktop) >= 0) markLayoutDirty();
 }
 static void switchDesktop(int desktop) {
   if (desktop == currentDesktop || desktop < 0 || desktop >= MAX_DESKTOPS) return;
-  Desktop *current = &desktops[currentDesktop];
-  for (unsigned char i = 0; i < current->windowCount; i++) {
-    XUnmapWindow(dpy, current->windows[i]);
+  int shown = monitorOf(desktop);
+  if (shown >= 0) {
+    /* already on another monitor, go there rather than take it away */
+    focusMonitor(shown);
+    return;
+  }
+  /* grab until flushLayout so no other client sees a half-switched screen */
+  if (!serverGrabbed) queueOp((XOp){.type = OP_GRAB});
+  serverGrabbed = 1;
+  hideDesktop(currentDesktop);
+  currentDesktop = monitors[currentMonitor].desktop = desktop;
+  markLayoutDirty();
+}
+static void hideDesktop(unsigned char desktop) {
+  for (Client *c = desktops[desktop].head; c; c = c->next) {
+    hideClient(c);
+    commitClient(c);
   }
-  currentDesktop  = desktop;
-  Desktop *target = &desktops[currentDesktop];
-  for (unsigned char i = 0; i < target->windowCount; i++) {
-    XMapWindow(dpy, target->windows[i]);
+}
+/* the monitor showing a desktop, or -1 if its windows are hidden */
+static int monitorOf(unsigned char desktop) {
+  for (int i = 0; i < monitorCount; i++) {
+    if (monitors[i].desktop == desktop) return i;
+  }
+  return -1;
+}
+/* the monitor containing a root position, or the current one in a gap between monitors */
+static int monitorAt(int x, int y) {
+  for (int i = 0; i < monitorCount; i++) {
+    XRectangle *a = &monitors[i].area;
+    if (x >= a->x && x < a->x + a->width && y >= a->y && y < a->y + a->height) return i;
   }
-  tileWindows();
-  if (target->windowCount > 0) {
-    focusWindow(target->windows[target->focusedIdx]);
+  return currentMonitor;
+}
+static void focusMonitor(int monitor) {
+  if (monitor == currentMonitor) return;
+  currentMonitor = monitor;
+  currentDesktop = monitors[monitor].desktop;
+  /* a relayout rather than a focus change, so an empty monitor takes the focus too */
+  markLayoutDirty();
+}
+/*
+ * Monitors that remain keep their desktops, new ones show the lowest desktops not shown yet and
+ * the windows of a monitor that went away are hidden.
+ */
+static void setMonitors(const XRectangle *areas, int count) {
+  while (monitorCount > count) hideDesktop(monitors[--monitorCount].desktop);
+  while (monitorCount < count) {
+    unsigned char desktop = 0;
+    while (monitorOf(desktop) >= 0) desktop++;
+    monitors[monitorCount++].desktop = desktop;
   }
+  for (int i = 0; i < count; i++) monitors[i].area = areas[i];
+  if (currentMonitor >= monitorCount) currentMonitor = 0;
+  currentDesktop = monitors[currentMonitor].desktop;
+  markLayoutDirty();
 }